@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// C++ headers
+#include <vector>
+
+// C++11 headers
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "pool.h"
+#include "queue.h"
+
+/**
+ * Contention benchmark for the hand-off between pipeline stages: 1 to n
+ * producer threads push a playlist's worth of album pointers at a single
+ * consumer, through bounded_queue and through the mutexed vector it
+ * replaced. Also times object_pool against new/delete for the albums.
+ *
+ *   ./bench_queue [items] [max producers]
+ *
+ * Best of ROUNDS runs each, in milliseconds.
+ */
+
+#define ROUNDS 5
+
+// deep enough that producers rarely wait, so this times the hand-off
+// itself. The fetcher keeps its track queue at 8 and feeds it from a heap
+#define QUEUE_CAPACITY 4096
+
+// stands in for struct request, about as big
+struct album
+{
+	char data[256];
+	int n;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+// every producer pushes its slice, the consumer sums what it pops
+static double run_queue(std::vector<album*> &items, int producers)
+{
+	bounded_queue<album*> queue(QUEUE_CAPACITY);
+	std::vector<std::thread> threads;
+	std::atomic<bool> go(false);
+	size_t total = items.size();
+	long long sum = 0;
+
+	for (int p = 0; p < producers; ++p) {
+		threads.push_back(std::thread([&, p] {
+			while (!go.load())
+				std::this_thread::yield();
+			for (size_t i = p; i < total; i += producers) {
+				while (!queue.push(items[i]))
+					std::this_thread::yield();
+			}
+		}));
+	}
+
+	bench_clock::time_point start = bench_clock::now();
+	go = true;
+	for (size_t got = 0; got < total; ) {
+		album *a;
+		if (queue.pop(a)) {
+			sum += a->n;
+			got++;
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	double ms = elapsed_ms(start);
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	if (sum != (long long)total * ((long long)total - 1) / 2)
+		fprintf(stderr, "[!] Queue lost albums\n");
+	return ms;
+}
+
+// what the track worker had before, popped from the back
+static double run_vector(std::vector<album*> &items, int producers)
+{
+	std::vector<album*> vec;
+	std::mutex mutex;
+	std::vector<std::thread> threads;
+	std::atomic<bool> go(false);
+	size_t total = items.size();
+	long long sum = 0;
+
+	for (int p = 0; p < producers; ++p) {
+		threads.push_back(std::thread([&, p] {
+			while (!go.load())
+				std::this_thread::yield();
+			for (size_t i = p; i < total; i += producers) {
+				std::lock_guard<std::mutex> lock(mutex);
+				vec.push_back(items[i]);
+			}
+		}));
+	}
+
+	bench_clock::time_point start = bench_clock::now();
+	go = true;
+	for (size_t got = 0; got < total; ) {
+		album *a = NULL;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!vec.empty()) {
+				a = vec.back();
+				vec.pop_back();
+			}
+		}
+		if (a) {
+			sum += a->n;
+			got++;
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	double ms = elapsed_ms(start);
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	if (sum != (long long)total * ((long long)total - 1) / 2)
+		fprintf(stderr, "[!] Vector lost albums\n");
+	return ms;
+}
+
+// a run takes every album out and puts it back, twice
+static double run_pool(size_t total)
+{
+	object_pool<album> pool(256);
+	std::vector<album*> out(total);
+
+	bench_clock::time_point start = bench_clock::now();
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < total; ++i) {
+			out[i] = pool.get();
+			out[i]->n = (int)i;
+		}
+		for (size_t i = 0; i < total; ++i)
+			pool.put(out[i]);
+	}
+	return elapsed_ms(start);
+}
+
+static double run_heap(size_t total)
+{
+	std::vector<album*> out(total);
+
+	bench_clock::time_point start = bench_clock::now();
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < total; ++i) {
+			out[i] = new album;
+			out[i]->n = (int)i;
+		}
+		for (size_t i = 0; i < total; ++i)
+			delete out[i];
+	}
+	return elapsed_ms(start);
+}
+
+static double best(double a, double b)
+{
+	return a < b ? a : b;
+}
+
+int main(int argc, char **argv)
+{
+	size_t total = argc > 1 && atoi(argv[1]) > 0 ? (size_t)atoi(argv[1]) : 100000;
+	int max_producers = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 4;
+
+	std::vector<album> albums(total);
+	std::vector<album*> items(total);
+	for (size_t i = 0; i < total; ++i) {
+		albums[i].n = (int)i;
+		items[i] = &albums[i];
+	}
+
+	printf("[*] %u albums, %u cores, best of %d\n", (unsigned int)total,
+		std::thread::hardware_concurrency(), ROUNDS);
+	printf("    producers   mutexed vector   bounded_queue\n");
+	for (int producers = 1; producers <= max_producers; producers *= 2) {
+		double vec = 1e9, queue = 1e9;
+		for (int r = 0; r < ROUNDS; ++r) {
+			vec = best(vec, run_vector(items, producers));
+			queue = best(queue, run_queue(items, producers));
+		}
+		printf("    %9d   %11.2f ms   %10.2f ms\n", producers, vec, queue);
+	}
+
+	double heap = 1e9, pool = 1e9;
+	for (int r = 0; r < ROUNDS; ++r) {
+		heap = best(heap, run_heap(total));
+		pool = best(pool, run_pool(total));
+	}
+	printf("    new/delete  %8.2f ms\n", heap);
+	printf("    object_pool %8.2f ms\n", pool);
+	return 0;
+}
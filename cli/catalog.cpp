@@ -0,0 +1,446 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef SPOTIFART_SQLITE
+#include <sqlite3.h>
+#endif
+
+// C++ headers
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// C++11 headers
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "catalog.h"
+
+#ifdef SPOTIFART_SQLITE
+
+// records per transaction, and how long one may wait for the batch to fill
+#define CATALOG_BATCH 1024
+#define CATALOG_FLUSH_MS 500
+
+// shards share the database, wait for each other's transactions
+#define CATALOG_BUSY_MS 10000
+
+static const char *schema =
+	"PRAGMA journal_mode=WAL;"
+	"PRAGMA synchronous=NORMAL;"
+	"CREATE TABLE IF NOT EXISTS playlists ("
+	" id INTEGER PRIMARY KEY, source TEXT UNIQUE NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS artists ("
+	" id INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS albums ("
+	" uri TEXT PRIMARY KEY, name TEXT, artist_id INTEGER REFERENCES artists(id), year INTEGER);"
+	"CREATE TABLE IF NOT EXISTS tracks ("
+	" playlist_id INTEGER NOT NULL REFERENCES playlists(id), position INTEGER NOT NULL,"
+	" name TEXT, artist_id INTEGER REFERENCES artists(id), album_uri TEXT,"
+	" PRIMARY KEY (playlist_id, position));"
+	"CREATE TABLE IF NOT EXISTS covers ("
+	" album_uri TEXT NOT NULL, file TEXT NOT NULL, image_id TEXT, bytes INTEGER,"
+	" fetched_at INTEGER, PRIMARY KEY (album_uri, file));"
+	"CREATE INDEX IF NOT EXISTS tracks_album ON tracks(album_uri);"
+	"CREATE INDEX IF NOT EXISTS covers_file ON covers(file);"
+	"CREATE INDEX IF NOT EXISTS covers_image ON covers(image_id);";
+
+enum op_kind
+{
+	OP_PLAYLIST,
+	OP_TRACK,
+	OP_ALBUM
+};
+
+struct catalog_op
+{
+	op_kind kind;
+	std::string source;	// playlist, or album URI
+	std::string name;
+	std::string artist;
+	std::string album_uri;	// track's album, or cover file
+	int number;		// track position, or album year
+	int64_t bytes;
+	std::string image_id;	// hex, "" if unknown
+};
+
+enum
+{
+	ST_PLAYLIST_INSERT,
+	ST_PLAYLIST_SELECT,
+	ST_ARTIST_INSERT,
+	ST_ARTIST_SELECT,
+	ST_TRACKS_DELETE,
+	ST_TRACK_INSERT,
+	ST_ALBUM_INSERT,
+	ST_COVER_INSERT,
+	ST_COUNT
+};
+
+static const char *statements[ST_COUNT] = {
+	"INSERT OR IGNORE INTO playlists (source) VALUES (?)",
+	"SELECT id FROM playlists WHERE source = ?",
+	"INSERT OR IGNORE INTO artists (name) VALUES (?)",
+	"SELECT id FROM artists WHERE name = ?",
+	"DELETE FROM tracks WHERE playlist_id = ?",
+	"INSERT OR REPLACE INTO tracks (playlist_id, position, name, artist_id, album_uri)"
+		" VALUES (?, ?, ?, ?, ?)",
+	"INSERT OR REPLACE INTO albums (uri, name, artist_id, year) VALUES (?, ?, ?, ?)",
+	"INSERT OR REPLACE INTO covers (album_uri, file, image_id, bytes, fetched_at)"
+		" VALUES (?, ?, ?, ?, ?)"
+};
+
+struct catalog
+{
+	sqlite3 *db;
+	sqlite3_stmt *st[ST_COUNT];
+	std::thread thread;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<catalog_op> todo;
+	bool closing;
+
+	// ids already looked up, writer thread only
+	std::unordered_map<std::string, sqlite3_int64> playlist_ids;
+	std::unordered_map<std::string, sqlite3_int64> artist_ids;
+};
+
+static bool step(struct catalog *c, int st)
+{
+	int ret = sqlite3_step(c->st[st]);
+	sqlite3_reset(c->st[st]);
+	sqlite3_clear_bindings(c->st[st]);
+	if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
+		fprintf(stderr, "[!] Catalog: %s\n", sqlite3_errmsg(c->db));
+		return false;
+	}
+	return true;
+}
+
+static void bind_text(sqlite3_stmt *st, int col, const std::string &s)
+{
+	if (s.empty())
+		sqlite3_bind_null(st, col);
+	else
+		sqlite3_bind_text(st, col, s.data(), (int)s.size(), SQLITE_STATIC);
+}
+
+// id of the row with this name in playlists or artists, added if need be
+static sqlite3_int64 lookup(struct catalog *c, int insert, int select,
+	std::unordered_map<std::string, sqlite3_int64> &cache, const std::string &key)
+{
+	if (key.empty())
+		return 0;
+	std::unordered_map<std::string, sqlite3_int64>::iterator it = cache.find(key);
+	if (it != cache.end())
+		return it->second;
+
+	bind_text(c->st[insert], 1, key);
+	if (!step(c, insert))
+		return 0;
+
+	sqlite3_int64 id = 0;
+	bind_text(c->st[select], 1, key);
+	if (sqlite3_step(c->st[select]) == SQLITE_ROW)
+		id = sqlite3_column_int64(c->st[select], 0);
+	sqlite3_reset(c->st[select]);
+	sqlite3_clear_bindings(c->st[select]);
+	if (id)
+		cache[key] = id;
+	return id;
+}
+
+static bool write_op(struct catalog *c, const catalog_op &op)
+{
+	sqlite3_stmt *st;
+	switch (op.kind) {
+	case OP_PLAYLIST: {
+		sqlite3_int64 id = lookup(c, ST_PLAYLIST_INSERT, ST_PLAYLIST_SELECT,
+			c->playlist_ids, op.source);
+		sqlite3_bind_int64(c->st[ST_TRACKS_DELETE], 1, id);
+		return step(c, ST_TRACKS_DELETE);
+	}
+
+	case OP_TRACK: {
+		sqlite3_int64 playlist = lookup(c, ST_PLAYLIST_INSERT, ST_PLAYLIST_SELECT,
+			c->playlist_ids, op.source);
+		sqlite3_int64 artist = lookup(c, ST_ARTIST_INSERT, ST_ARTIST_SELECT,
+			c->artist_ids, op.artist);
+		st = c->st[ST_TRACK_INSERT];
+		sqlite3_bind_int64(st, 1, playlist);
+		sqlite3_bind_int(st, 2, op.number);
+		bind_text(st, 3, op.name);
+		if (artist)
+			sqlite3_bind_int64(st, 4, artist);
+		bind_text(st, 5, op.album_uri);
+		return step(c, ST_TRACK_INSERT);
+	}
+
+	case OP_ALBUM: {
+		sqlite3_int64 artist = lookup(c, ST_ARTIST_INSERT, ST_ARTIST_SELECT,
+			c->artist_ids, op.artist);
+		st = c->st[ST_ALBUM_INSERT];
+		bind_text(st, 1, op.source);
+		bind_text(st, 2, op.name);
+		if (artist)
+			sqlite3_bind_int64(st, 3, artist);
+		if (op.number > 0)
+			sqlite3_bind_int(st, 4, op.number);
+		if (!step(c, ST_ALBUM_INSERT))
+			return false;
+		if (op.album_uri.empty())
+			return true;
+
+		st = c->st[ST_COVER_INSERT];
+		bind_text(st, 1, op.source);
+		bind_text(st, 2, op.album_uri);
+		bind_text(st, 3, op.image_id);
+		sqlite3_bind_int64(st, 4, op.bytes);
+		sqlite3_bind_int64(st, 5, (sqlite3_int64)time(NULL));
+		return step(c, ST_COVER_INSERT);
+	}
+	}
+	return false;
+}
+
+// one transaction for the whole batch, that's what makes it cheap
+static void write_batch(struct catalog *c, const std::vector<catalog_op> &batch)
+{
+	// IMMEDIATE takes the write lock up front, so two shards wait for each
+	// other instead of failing halfway
+	if (sqlite3_exec(c->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "[!] Catalog: %s, %u records lost\n", sqlite3_errmsg(c->db),
+			(unsigned int)batch.size());
+		return;
+	}
+	for (size_t i = 0; i < batch.size(); ++i)
+		write_op(c, batch[i]);
+	if (sqlite3_exec(c->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "[!] Catalog: %s, %u records lost\n", sqlite3_errmsg(c->db),
+			(unsigned int)batch.size());
+		sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+		// the ids may have been rolled back with it
+		c->playlist_ids.clear();
+		c->artist_ids.clear();
+	}
+}
+
+static void catalog_work(struct catalog *c)
+{
+	std::unique_lock<std::mutex> lock(c->mutex);
+	for (;;) {
+		c->cond.wait_for(lock, std::chrono::milliseconds(CATALOG_FLUSH_MS),
+			[c] { return c->closing || c->todo.size() >= CATALOG_BATCH; });
+		if (c->todo.empty()) {
+			if (c->closing)
+				return;
+			continue;
+		}
+
+		std::vector<catalog_op> batch;
+		batch.swap(c->todo);
+		lock.unlock();
+		write_batch(c, batch);
+		lock.lock();
+	}
+}
+
+static void queue(struct catalog *c, catalog_op &op)
+{
+	std::lock_guard<std::mutex> lock(c->mutex);
+	c->todo.push_back(std::move(op));
+	if (c->todo.size() >= CATALOG_BATCH)
+		c->cond.notify_one();
+}
+
+static sqlite3 *db_open(const char *path)
+{
+	sqlite3 *db = NULL;
+	if (sqlite3_open(path, &db) != SQLITE_OK) {
+		fprintf(stderr, "[!] Unable to open catalog %s: %s\n", path,
+			db ? sqlite3_errmsg(db) : "out of memory");
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, CATALOG_BUSY_MS);
+	return db;
+}
+
+struct catalog *catalog_open(const char *path)
+{
+	sqlite3 *db = db_open(path);
+	if (!db)
+		return NULL;
+
+	char *err = NULL;
+	if (sqlite3_exec(db, schema, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "[!] Unable to set up catalog %s: %s\n", path, err);
+		sqlite3_free(err);
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	struct catalog *c = new struct catalog;
+	c->db = db;
+	c->closing = false;
+	for (int i = 0; i < ST_COUNT; ++i) {
+		c->st[i] = NULL;
+		if (sqlite3_prepare_v2(db, statements[i], -1, &c->st[i], NULL) != SQLITE_OK) {
+			fprintf(stderr, "[!] Catalog: %s\n", sqlite3_errmsg(db));
+			for (int j = 0; j < i; ++j)
+				sqlite3_finalize(c->st[j]);
+			sqlite3_close(db);
+			delete c;
+			return NULL;
+		}
+	}
+	c->thread = std::thread(catalog_work, c);
+	return c;
+}
+
+void catalog_close(struct catalog *c)
+{
+	if (!c)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(c->mutex);
+		c->closing = true;
+	}
+	c->cond.notify_one();
+	c->thread.join();
+
+	for (int i = 0; i < ST_COUNT; ++i)
+		sqlite3_finalize(c->st[i]);
+	sqlite3_close(c->db);
+	delete c;
+}
+
+void catalog_playlist(struct catalog *c, const char *source)
+{
+	if (!c)
+		return;
+	catalog_op op;
+	op.kind = OP_PLAYLIST;
+	op.source = source;
+	op.number = 0;
+	op.bytes = 0;
+	queue(c, op);
+}
+
+void catalog_track(struct catalog *c, const char *source, int position,
+	const char *name, const char *artist, const char *album_uri)
+{
+	if (!c)
+		return;
+	catalog_op op;
+	op.kind = OP_TRACK;
+	op.source = source;
+	op.name = name;
+	op.artist = artist;
+	op.album_uri = album_uri;
+	op.number = position;
+	op.bytes = 0;
+	queue(c, op);
+}
+
+void catalog_album(struct catalog *c, const char *uri, const char *name,
+	const char *artist, int year, const uint8_t *image_id, const char *file,
+	size_t bytes)
+{
+	static const char hex[] = "0123456789abcdef";
+	if (!c)
+		return;
+	catalog_op op;
+	op.kind = OP_ALBUM;
+	op.source = uri;
+	op.name = name;
+	op.artist = artist;
+	op.album_uri = file;
+	op.number = year;
+	op.bytes = bytes;
+	for (int i = 0; image_id && i < 20; ++i) {
+		op.image_id += hex[image_id[i] >> 4];
+		op.image_id += hex[image_id[i] & 15];
+	}
+	queue(c, op);
+}
+
+int catalog_query(const char *path, const char *cover)
+{
+	sqlite3 *db = db_open(path);
+	if (!db)
+		return -1;
+
+	// the cover's album, whether it was given as a file, image ID or URI
+	const char *sql =
+		"SELECT DISTINCT p.source FROM tracks t"
+		" JOIN playlists p ON p.id = t.playlist_id"
+		" WHERE t.album_uri IN ("
+		"  SELECT album_uri FROM covers WHERE file = ?1 OR image_id = lower(?1)"
+		"  UNION SELECT ?1)"
+		" ORDER BY p.source";
+
+	sqlite3_stmt *st = NULL;
+	if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) {
+		fprintf(stderr, "[!] Catalog: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return -1;
+	}
+	sqlite3_bind_text(st, 1, cover, -1, SQLITE_STATIC);
+
+	int found = 0;
+	int ret;
+	while ((ret = sqlite3_step(st)) == SQLITE_ROW) {
+		printf("%s\n", (const char*)sqlite3_column_text(st, 0));
+		found++;
+	}
+	if (ret != SQLITE_DONE) {
+		fprintf(stderr, "[!] Catalog: %s\n", sqlite3_errmsg(db));
+		found = -1;
+	}
+
+	sqlite3_finalize(st);
+	sqlite3_close(db);
+	return found;
+}
+
+#else
+
+struct catalog *catalog_open(const char *path)
+{
+	fprintf(stderr, "[!] Built without SQLite, no catalog\n");
+	return NULL;
+}
+
+void catalog_close(struct catalog *c)
+{
+}
+
+void catalog_playlist(struct catalog *c, const char *source)
+{
+}
+
+void catalog_track(struct catalog *c, const char *source, int position,
+	const char *name, const char *artist, const char *album_uri)
+{
+}
+
+void catalog_album(struct catalog *c, const char *uri, const char *name,
+	const char *artist, int year, const uint8_t *image_id, const char *file,
+	size_t bytes)
+{
+}
+
+int catalog_query(const char *path, const char *cover)
+{
+	fprintf(stderr, "[!] Built without SQLite, no catalog\n");
+	return -1;
+}
+
+#endif
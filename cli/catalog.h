@@ -0,0 +1,49 @@
+#ifndef SPOTIFART_CATALOG_H
+#define SPOTIFART_CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * SQLite index of every playlist, track, album, artist and cover fetched,
+ * across runs, so "where did this cover come from" and "which playlists
+ * use it" are one query:
+ *
+ *   playlists (id, source)
+ *   artists   (id, name)
+ *   albums    (uri, name, artist_id, year)
+ *   tracks    (playlist_id, position, name, artist_id, album_uri)
+ *   covers    (album_uri, file, image_id, bytes, fetched_at)
+ *
+ * Calls only queue the record. A thread of its own writes them in
+ * batches, one WAL transaction per batch, so the fetcher thread never
+ * waits on the disk. Calls are for one thread, the fetcher's, and every
+ * one accepts a NULL catalog and does nothing. Needs SQLite
+ * (SPOTIFART_SQLITE), catalog_open() fails without it.
+ */
+struct catalog;
+
+// NULL if the database can't be opened or set up
+struct catalog *catalog_open(const char *path);
+
+// writes whatever is queued
+void catalog_close(struct catalog *c);
+
+// the playlist is being scanned again, forget the tracks it had
+void catalog_playlist(struct catalog *c, const char *source);
+
+void catalog_track(struct catalog *c, const char *source, int position,
+	const char *name, const char *artist, const char *album_uri);
+
+// image_id is 20 bytes, file empty unless a cover was written
+void catalog_album(struct catalog *c, const char *uri, const char *name,
+	const char *artist, int year, const uint8_t *image_id, const char *file,
+	size_t bytes);
+
+/**
+ * Print every playlist using a cover, found by its file, album URI or
+ * image ID (hex). Returns how many there were, -1 on error.
+ */
+int catalog_query(const char *path, const char *cover);
+
+#endif
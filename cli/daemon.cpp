@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// C++ headers
+#include <string>
+#include <vector>
+
+// C++11 headers
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "daemon.h"
+
+#ifdef _WIN32
+
+bool daemon_start(const char *path, const char *outdir, daemon_submit_fn submit)
+{
+	fprintf(stderr, "[!] Daemon mode needs Unix domain sockets, not supported on Windows\n");
+	return false;
+}
+
+void daemon_stop()
+{
+}
+
+void daemon_reply(int client, const std::string &text)
+{
+}
+
+#else
+
+static std::thread g_daemon_thread;
+static std::atomic<bool> g_daemon_run(false);
+static int g_daemon_sock = -1;
+static std::string g_daemon_path;
+static std::string g_daemon_outdir;
+static daemon_submit_fn g_daemon_submit = NULL;
+
+// a client gets this long to send its whole request line
+#define REQUEST_TIMEOUT_MS 5000
+#define REQUEST_MAX 4096
+
+// connections being read at once, the rest wait in the listen backlog
+#define MAX_READING 64
+
+// a connection whose request line isn't complete yet
+struct reading
+{
+	int fd;
+	std::string line;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+// the request line is in, hand it on or turn it down
+static void handle_request(int client, std::string line)
+{
+	size_t eol = line.find('\n');
+	if (eol != std::string::npos)
+		line.erase(eol);
+	if (!line.empty() && line[line.size() - 1] == '\r')
+		line.erase(line.size() - 1);
+	if (line.empty()) {
+		daemon_reply(client, "ERR bad request\n");
+		return;
+	}
+
+	std::string source = line;
+	std::string outdir = g_daemon_outdir;
+	size_t tab = line.find('\t');
+	if (tab != std::string::npos) {
+		source = line.substr(0, tab);
+		outdir = line.substr(tab + 1);
+	}
+
+	// the submitter owns the connection from here on
+	g_daemon_submit(source, outdir, client);
+}
+
+// false once the client is dealt with, one way or another
+static bool read_more(struct reading &r)
+{
+	char buf[512];
+	ssize_t n = recv(r.fd, buf, sizeof(buf), 0);
+	if (n <= 0) {
+		// hung up after sending, take what there is
+		if (!r.line.empty())
+			handle_request(r.fd, r.line);
+		else
+			close(r.fd);
+		return false;
+	}
+	r.line.append(buf, n);
+	if (r.line.find('\n') != std::string::npos) {
+		handle_request(r.fd, r.line);
+		return false;
+	}
+	if (r.line.size() >= REQUEST_MAX) {
+		daemon_reply(r.fd, "ERR bad request\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Accept connections and read their request lines side by side, so a
+ * client that is slow to send never holds up the others. Each has one
+ * deadline for the whole line, however it trickles in.
+ */
+static void daemon_work()
+{
+	typedef std::chrono::steady_clock clock;
+	std::vector<reading> clients;
+
+	while (g_daemon_run.load()) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		int maxfd = -1;
+		if (clients.size() < MAX_READING) {
+			FD_SET(g_daemon_sock, &fds);
+			maxfd = g_daemon_sock;
+		}
+
+		// wake up for the first deadline, and at least once a second
+		clock::time_point now = clock::now();
+		clock::time_point wake = now + std::chrono::seconds(1);
+		for (size_t i = 0; i < clients.size(); ++i) {
+			FD_SET(clients[i].fd, &fds);
+			if (clients[i].fd > maxfd)
+				maxfd = clients[i].fd;
+			if (clients[i].deadline < wake)
+				wake = clients[i].deadline;
+		}
+		int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(wake - now).count();
+		if (us < 0)
+			us = 0;
+		struct timeval tv = { (time_t)(us / 1000000), (suseconds_t)(us % 1000000) };
+		int ready = select(maxfd + 1, &fds, NULL, NULL, &tv);
+		if (ready < 0 && errno != EINTR)
+			continue;
+
+		now = clock::now();
+		for (size_t i = 0; i < clients.size(); ) {
+			bool keep = true;
+			if (ready > 0 && FD_ISSET(clients[i].fd, &fds))
+				keep = read_more(clients[i]);
+			else if (clients[i].deadline <= now) {
+				daemon_reply(clients[i].fd, "ERR bad request\n");
+				keep = false;
+			}
+			if (keep) {
+				++i;
+			} else {
+				clients[i] = clients.back();
+				clients.pop_back();
+			}
+		}
+
+		if (ready > 0 && FD_ISSET(g_daemon_sock, &fds)) {
+			int client = accept(g_daemon_sock, NULL, NULL);
+			if (client >= FD_SETSIZE) {
+				daemon_reply(client, "ERR busy\n");
+			} else if (client >= 0) {
+				reading r;
+				r.fd = client;
+				r.deadline = now + std::chrono::milliseconds(REQUEST_TIMEOUT_MS);
+				clients.push_back(r);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < clients.size(); ++i)
+		close(clients[i].fd);
+}
+
+bool daemon_start(const char *path, const char *outdir, daemon_submit_fn submit)
+{
+	struct sockaddr_un addr = {};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "[!] Socket path too long: %s\n", path);
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	g_daemon_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (g_daemon_sock < 0) {
+		fprintf(stderr, "[!] Unable to create socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	// a stale socket from a previous daemon would make bind fail, but
+	// anything else at the path isn't ours to remove
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(g_daemon_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(g_daemon_sock, 16) != 0) {
+		fprintf(stderr, "[!] Unable to listen on %s: %s\n", path, strerror(errno));
+		close(g_daemon_sock);
+		g_daemon_sock = -1;
+		return false;
+	}
+
+	// a client hanging up early must not take the daemon down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("[*] Accepting jobs on %s\n", path);
+	g_daemon_path = path;
+	g_daemon_outdir = outdir;
+	g_daemon_submit = submit;
+	g_daemon_run = true;
+	g_daemon_thread = std::thread(daemon_work);
+	return true;
+}
+
+void daemon_stop()
+{
+	if (!g_daemon_run.load())
+		return;
+	g_daemon_run = false;
+	g_daemon_thread.join();
+	close(g_daemon_sock);
+	g_daemon_sock = -1;
+	unlink(g_daemon_path.c_str());
+}
+
+void daemon_reply(int client, const std::string &text)
+{
+	if (client < 0)
+		return;
+	const char *p = text.data();
+	size_t left = text.size();
+	while (left > 0) {
+		ssize_t n = send(client, p, left, 0);
+		if (n <= 0)
+			break;
+		p += n;
+		left -= n;
+	}
+	close(client);
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SPOTIFART_DAEMON_H
+#define SPOTIFART_DAEMON_H
+
+#include <string>
+
+/**
+ * Accept jobs on a Unix domain socket. One job per connection: the client
+ * writes a single line
+ *
+ *   <playlist name or URI>[<TAB><output directory>]
+ *
+ * and gets a single status line back once the job is done; without a
+ * directory the job goes to outdir. Jobs are handed to submit from the
+ * listener thread, which owns the connection from then on and answers it
+ * with daemon_reply().
+ */
+typedef void (*daemon_submit_fn)(const std::string &source, const std::string &outdir,
+	int client);
+
+bool daemon_start(const char *path, const char *outdir, daemon_submit_fn submit);
+void daemon_stop();
+
+// answer a client and hang up
+void daemon_reply(int client, const std::string &text);
+
+#endif
@@ -0,0 +1,571 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#ifdef SPOTIFART_WEBP
+#include <webp/encode.h>
+#endif
+#ifdef SPOTIFART_AVIF
+#include <avif/avif.h>
+#endif
+
+// C++ headers
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// C++11 headers
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "derive.h"
+#include "jpegerr.h"
+
+// encoder quality, 0-100 everywhere
+#define JPEG_QUALITY 82
+#define WEBP_QUALITY 80
+#define AVIF_QUALITY 60
+
+// AVIF encoder speed, 0 (slowest, smallest) to 10
+#define AVIF_SPEED 8
+
+static const char *format_name(derive_format f)
+{
+	switch (f) {
+	case DERIVE_WEBP: return "webp";
+	case DERIVE_AVIF: return "avif";
+	default: return "jpeg";
+	}
+}
+
+static const char *format_ext(derive_format f)
+{
+	switch (f) {
+	case DERIVE_WEBP: return "webp";
+	case DERIVE_AVIF: return "avif";
+	default: return "jpg";
+	}
+}
+
+// every format needs libjpeg as well, to decode the cover
+static bool format_built(derive_format f)
+{
+#ifdef SPOTIFART_JPEG
+	switch (f) {
+	case DERIVE_JPEG: return true;
+#ifdef SPOTIFART_WEBP
+	case DERIVE_WEBP: return true;
+#endif
+#ifdef SPOTIFART_AVIF
+	case DERIVE_AVIF: return true;
+#endif
+	default: return false;
+	}
+#else
+	return false;
+#endif
+}
+
+bool derive_parse(const char *s, std::vector<derive_spec> &out)
+{
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		size_t colon = item.find(':');
+		std::string name = item.substr(0, colon);
+		int size = colon == std::string::npos ? 0 : atoi(item.c_str() + colon + 1);
+
+		derive_spec spec;
+		if (name == "jpeg" || name == "jpg")
+			spec.format = DERIVE_JPEG;
+		else if (name == "webp")
+			spec.format = DERIVE_WEBP;
+		else if (name == "avif")
+			spec.format = DERIVE_AVIF;
+		else {
+			fprintf(stderr, "[!] Unknown derivative format %s\n", name.c_str());
+			return false;
+		}
+		if (size <= 0) {
+			fprintf(stderr, "[!] Derivative %s needs a size, like %s:300\n",
+				item.c_str(), name.c_str());
+			return false;
+		}
+		if (!format_built(spec.format)) {
+#ifdef SPOTIFART_JPEG
+			fprintf(stderr, "[!] Built without %s support\n", format_name(spec.format));
+#else
+			fprintf(stderr, "[!] Built without jpeg support, no derivatives\n");
+#endif
+			return false;
+		}
+		spec.size = size;
+		out.push_back(spec);
+	}
+	return !out.empty();
+}
+
+std::string derive_path(const std::string &cover, const derive_spec &spec)
+{
+	size_t dot = cover.find_last_of('.');
+	size_t slash = cover.find_last_of("/\\");
+	std::string stem = cover;
+	if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+		stem = cover.substr(0, dot);
+
+	std::stringstream ss;
+	ss << stem << "." << spec.size << "." << format_ext(spec.format);
+	return ss.str();
+}
+
+static bool ends_with(const std::string &s, const std::string &suffix)
+{
+	size_t n = suffix.size();
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// "Name.300.jpg" when jpeg:300 is one of the specs, so a tree walk doesn't
+// take it for a cover. "Symphony No.5.jpg" is a cover unless there's a jpeg:5
+static bool is_derivative(const std::vector<derive_spec> &specs, const std::string &name)
+{
+	for (size_t i = 0; i < specs.size(); ++i) {
+		std::stringstream ss;
+		ss << "." << specs[i].size << "." << format_ext(specs[i].format);
+		if (name.size() > ss.str().size() && ends_with(name, ss.str()))
+			return true;
+	}
+	return false;
+}
+
+// 0 if it isn't there
+static time_t mtime(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
+
+static bool save(const std::string &filename, const void *data, size_t len)
+{
+	std::string tmp = filename + ".part";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp)
+		return false;
+	bool ok = fwrite(data, 1, len, fp) == len;
+	if (fclose(fp) != 0)
+		ok = false;
+#ifdef _WIN32
+	if (ok)
+		remove(filename.c_str());
+#endif
+	if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// an RGB image, 3 bytes a pixel, no padding
+struct bitmap
+{
+	int width;
+	int height;
+	std::vector<unsigned char> rgb;
+};
+
+// area average, for scaling down only
+static void shrink(const bitmap &src, int width, int height, bitmap &dst)
+{
+	dst.width = width;
+	dst.height = height;
+	dst.rgb.resize((size_t)width * height * 3);
+
+	for (int y = 0; y < height; ++y) {
+		int y0 = y * src.height / height;
+		int y1 = (y + 1) * src.height / height;
+		if (y1 <= y0)
+			y1 = y0 + 1;
+		for (int x = 0; x < width; ++x) {
+			int x0 = x * src.width / width;
+			int x1 = (x + 1) * src.width / width;
+			if (x1 <= x0)
+				x1 = x0 + 1;
+
+			unsigned int sum[3] = { 0, 0, 0 };
+			for (int sy = y0; sy < y1; ++sy) {
+				const unsigned char *p = &src.rgb[((size_t)sy * src.width + x0) * 3];
+				for (int sx = x0; sx < x1; ++sx, p += 3) {
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+				}
+			}
+			unsigned int n = (unsigned int)((y1 - y0) * (x1 - x0));
+			unsigned char *q = &dst.rgb[((size_t)y * width + x) * 3];
+			for (int c = 0; c < 3; ++c)
+				q[c] = (unsigned char)((sum[c] + n / 2) / n);
+		}
+	}
+}
+
+#ifdef SPOTIFART_JPEG
+
+/**
+ * Decode to RGB, letting libjpeg scale by n/8 in the DCT on the way so a
+ * big cover is never fully decoded just to be shrunk. The result is still
+ * at least min_size on its longest edge, unless the cover itself isn't.
+ */
+static bool jpeg_load(const std::string &filename, int min_size, bitmap &out)
+{
+	struct jpeg_decompress_struct src;
+	struct jpeg_error err;
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (!fp)
+		return false;
+
+	src.err = jpeg_error_init(&err);
+	jpeg_create_decompress(&src);
+	if (setjmp(err.jump)) {
+		jpeg_destroy_decompress(&src);
+		fclose(fp);
+		return false;
+	}
+
+	jpeg_stdio_src(&src, fp);
+	jpeg_read_header(&src, TRUE);
+	src.out_color_space = JCS_RGB;
+
+	int longest = src.image_width > src.image_height ? src.image_width : src.image_height;
+	src.scale_denom = 8;
+	src.scale_num = 1;
+	while (src.scale_num < 8 && (int)(longest * src.scale_num / 8) < min_size)
+		src.scale_num++;
+
+	jpeg_start_decompress(&src);
+	out.width = src.output_width;
+	out.height = src.output_height;
+	out.rgb.resize((size_t)out.width * out.height * 3);
+	while (src.output_scanline < src.output_height) {
+		JSAMPROW row = &out.rgb[(size_t)src.output_scanline * out.width * 3];
+		jpeg_read_scanlines(&src, &row, 1);
+	}
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	fclose(fp);
+	return true;
+}
+
+static bool jpeg_encode(const bitmap &img, std::vector<unsigned char> &out)
+{
+	struct jpeg_compress_struct dst;
+	struct jpeg_error err;
+	unsigned char *buf = NULL;
+	unsigned long size = 0;
+
+	dst.err = jpeg_error_init(&err);
+	jpeg_create_compress(&dst);
+	if (setjmp(err.jump)) {
+		jpeg_destroy_compress(&dst);
+		free(buf);
+		return false;
+	}
+
+	jpeg_mem_dest(&dst, &buf, &size);
+	dst.image_width = img.width;
+	dst.image_height = img.height;
+	dst.input_components = 3;
+	dst.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&dst);
+	jpeg_set_quality(&dst, JPEG_QUALITY, TRUE);
+	dst.optimize_coding = TRUE;
+
+	jpeg_start_compress(&dst, TRUE);
+	while (dst.next_scanline < dst.image_height) {
+		JSAMPROW row = const_cast<JSAMPROW>(&img.rgb[(size_t)dst.next_scanline * img.width * 3]);
+		jpeg_write_scanlines(&dst, &row, 1);
+	}
+	jpeg_finish_compress(&dst);
+
+	out.assign(buf, buf + size);
+	jpeg_destroy_compress(&dst);
+	free(buf);
+	return true;
+}
+
+#endif
+
+#ifdef SPOTIFART_WEBP
+
+static bool webp_encode(const bitmap &img, std::vector<unsigned char> &out)
+{
+	uint8_t *buf = NULL;
+	size_t size = WebPEncodeRGB(&img.rgb[0], img.width, img.height, img.width * 3,
+		WEBP_QUALITY, &buf);
+	if (size == 0)
+		return false;
+	out.assign(buf, buf + size);
+	WebPFree(buf);
+	return true;
+}
+
+#endif
+
+#ifdef SPOTIFART_AVIF
+
+static bool avif_encode(const bitmap &img, std::vector<unsigned char> &out)
+{
+	avifImage *image = avifImageCreate(img.width, img.height, 8, AVIF_PIXEL_FORMAT_YUV420);
+	avifEncoder *encoder = avifEncoderCreate();
+	avifRWData data = AVIF_DATA_EMPTY;
+	bool ok = false;
+
+	avifRGBImage rgb;
+	avifRGBImageSetDefaults(&rgb, image);
+	rgb.format = AVIF_RGB_FORMAT_RGB;
+	rgb.pixels = const_cast<uint8_t*>(&img.rgb[0]);
+	rgb.rowBytes = img.width * 3;
+
+	// the pool already keeps every core busy, one thread per image
+	encoder->maxThreads = 1;
+	encoder->speed = AVIF_SPEED;
+	encoder->quality = AVIF_QUALITY;
+
+	if (image && encoder && avifImageRGBToYUV(image, &rgb) == AVIF_RESULT_OK &&
+		avifEncoderWrite(encoder, image, &data) == AVIF_RESULT_OK) {
+		out.assign(data.data, data.data + data.size);
+		ok = true;
+	}
+
+	avifRWDataFree(&data);
+	if (encoder)
+		avifEncoderDestroy(encoder);
+	if (image)
+		avifImageDestroy(image);
+	return ok;
+}
+
+#endif
+
+static bool encode(derive_format format, const bitmap &img, std::vector<unsigned char> &out)
+{
+	switch (format) {
+#ifdef SPOTIFART_JPEG
+	case DERIVE_JPEG: return jpeg_encode(img, out);
+#endif
+#ifdef SPOTIFART_WEBP
+	case DERIVE_WEBP: return webp_encode(img, out);
+#endif
+#ifdef SPOTIFART_AVIF
+	case DERIVE_AVIF: return avif_encode(img, out);
+#endif
+	default: return false;
+	}
+}
+
+struct deriver
+{
+	std::vector<derive_spec> specs;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable work_cond;
+	std::deque<std::string> todo;
+	bool closing;
+
+	std::atomic<unsigned int> covers;
+	std::atomic<unsigned int> written;
+	std::atomic<unsigned int> current;	// already up to date
+	std::atomic<unsigned int> failed;
+};
+
+// every derivative of one cover that is missing or stale
+static void derive_cover(struct deriver *d, const std::string &cover)
+{
+	time_t cover_time = mtime(cover);
+	if (!cover_time) {
+		fprintf(stderr, "[!] Cover %s is gone, no derivatives\n", cover.c_str());
+		d->failed++;
+		return;
+	}
+
+	std::vector<size_t> stale;
+	int largest = 0;
+	for (size_t i = 0; i < d->specs.size(); ++i) {
+		if (mtime(derive_path(cover, d->specs[i])) >= cover_time) {
+			d->current++;
+			continue;
+		}
+		stale.push_back(i);
+		if (d->specs[i].size > largest)
+			largest = d->specs[i].size;
+	}
+	if (stale.empty())
+		return;
+
+	bitmap full;
+#ifdef SPOTIFART_JPEG
+	bool loaded = jpeg_load(cover, largest, full);
+#else
+	bool loaded = false;
+#endif
+	if (!loaded) {
+		fprintf(stderr, "[!] Unable to decode %s\n", cover.c_str());
+		d->failed += (unsigned int)stale.size();
+		return;
+	}
+
+	for (size_t i = 0; i < stale.size(); ++i) {
+		const derive_spec &spec = d->specs[stale[i]];
+		std::string filename = derive_path(cover, spec);
+
+		// longest edge down to size, never up
+		bitmap scaled;
+		const bitmap *img = &full;
+		int longest = full.width > full.height ? full.width : full.height;
+		if (longest > spec.size) {
+			int w = (int)((int64_t)full.width * spec.size / longest);
+			int h = (int)((int64_t)full.height * spec.size / longest);
+			shrink(full, w > 0 ? w : 1, h > 0 ? h : 1, scaled);
+			img = &scaled;
+		}
+
+		std::vector<unsigned char> data;
+		if (!encode(spec.format, *img, data) || !save(filename, &data[0], data.size())) {
+			fprintf(stderr, "[!] Unable to write %s\n", filename.c_str());
+			d->failed++;
+			continue;
+		}
+		d->written++;
+	}
+}
+
+static void deriver_work(struct deriver *d)
+{
+	std::unique_lock<std::mutex> lock(d->mutex);
+	for (;;) {
+		d->work_cond.wait(lock, [d] { return d->closing || !d->todo.empty(); });
+		if (d->todo.empty())
+			return;
+
+		std::string cover = d->todo.front();
+		d->todo.pop_front();
+		lock.unlock();
+
+		derive_cover(d, cover);
+
+		lock.lock();
+	}
+}
+
+struct deriver *deriver_open(const std::vector<derive_spec> &specs, int threads)
+{
+	struct deriver *d = new struct deriver;
+	d->specs = specs;
+	d->closing = false;
+	d->covers = 0;
+	d->written = 0;
+	d->current = 0;
+	d->failed = 0;
+
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	for (int i = 0; i < (threads > 0 ? threads : 1); ++i)
+		d->threads.push_back(std::thread(deriver_work, d));
+	return d;
+}
+
+bool deriver_close(struct deriver *d)
+{
+	if (!d)
+		return true;
+	{
+		std::lock_guard<std::mutex> lock(d->mutex);
+		d->closing = true;
+	}
+	d->work_cond.notify_all();
+	for (size_t i = 0; i < d->threads.size(); ++i)
+		d->threads[i].join();
+
+	if (d->covers.load())
+		printf("[*] Derivatives of %u covers: %u written, %u up to date, %u failed\n",
+			d->covers.load(), d->written.load(), d->current.load(), d->failed.load());
+	bool ok = d->failed.load() == 0;
+	delete d;
+	return ok;
+}
+
+void deriver_put(struct deriver *d, const std::string &cover)
+{
+	if (!d)
+		return;
+	d->covers++;
+	std::lock_guard<std::mutex> lock(d->mutex);
+	d->todo.push_back(cover);
+	d->work_cond.notify_one();
+}
+
+int deriver_put_tree(struct deriver *d, const std::string &dir)
+{
+	int found = 0;
+	std::vector<std::string> subdirs;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &fd);
+	if (h == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "[!] Unable to read directory %s\n", dir.c_str());
+		return 0;
+	}
+	do {
+		std::string name = fd.cFileName;
+		if (name == "." || name == "..")
+			continue;
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			subdirs.push_back(dir + "\\" + name);
+		else if (ends_with(name, ".jpg") && !is_derivative(d->specs, name)) {
+			deriver_put(d, dir + "\\" + name);
+			found++;
+		}
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	DIR *dp = opendir(dir.c_str());
+	if (!dp) {
+		fprintf(stderr, "[!] Unable to read directory %s\n", dir.c_str());
+		return 0;
+	}
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		std::string name = de->d_name;
+		if (name == "." || name == "..")
+			continue;
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			subdirs.push_back(path);
+		else if (ends_with(name, ".jpg") && !is_derivative(d->specs, name)) {
+			deriver_put(d, path);
+			found++;
+		}
+	}
+	closedir(dp);
+#endif
+
+	for (size_t i = 0; i < subdirs.size(); ++i)
+		found += deriver_put_tree(d, subdirs[i]);
+	return found;
+}
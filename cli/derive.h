@@ -0,0 +1,59 @@
+#ifndef SPOTIFART_DERIVE_H
+#define SPOTIFART_DERIVE_H
+
+// C++ headers
+#include <string>
+#include <vector>
+
+enum derive_format
+{
+	DERIVE_JPEG,
+	DERIVE_WEBP,		// needs libwebp (SPOTIFART_WEBP)
+	DERIVE_AVIF		// needs libavif (SPOTIFART_AVIF)
+};
+
+// one smaller copy of every cover, size is its longest edge in pixels
+struct derive_spec
+{
+	derive_format format;
+	int size;
+};
+
+/**
+ * Parse a list like "webp:300,webp:640,avif:300,jpeg:64". False, with a
+ * message, for anything malformed or a format this build can't encode.
+ * Covers are decoded with libjpeg, so without it every format is refused.
+ */
+bool derive_parse(const char *s, std::vector<derive_spec> &out);
+
+/**
+ * Where a derivative of cover goes: next to it, with the size and the
+ * format's extension, "Artist - Album.jpg" -> "Artist - Album.300.webp".
+ * Covers are never scaled up, a smaller one is only re-encoded.
+ */
+std::string derive_path(const std::string &cover, const derive_spec &spec);
+
+/**
+ * Pool of worker threads making derivatives. Every cover put is decoded
+ * once and whichever derivatives are missing or older than it are
+ * written, so putting the same cover again is cheap. Covers must be JPEG
+ * and stay where they are until the pool is done with them.
+ *
+ * put is for one thread at a time. close finishes everything put so far,
+ * prints a summary and is false if any derivative couldn't be made.
+ */
+struct deriver;
+
+// threads 0 uses every core
+struct deriver *deriver_open(const std::vector<derive_spec> &specs, int threads);
+bool deriver_close(struct deriver *d);
+void deriver_put(struct deriver *d, const std::string &cover);
+
+/**
+ * Put every cover under dir, layout subdirectories included, skipping
+ * files named like a derivative of d's specs. Returns how many covers
+ * were found.
+ */
+int deriver_put_tree(struct deriver *d, const std::string &dir);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "export.h"
+
+// formatted records collect here before going to the file in one write
+#define EXPORT_BUFFER_SIZE (256 * 1024)
+
+static const char *csv_header =
+	"type,playlist,position,track,artist,album,album_uri,available,"
+	"year,album_type,image_id,file,bytes,status,reason\n";
+
+struct exporter
+{
+	FILE *fp;
+	export_format format;
+	char *buf;
+	size_t used;
+	bool first;		// no field in this record yet
+};
+
+void export_flush(struct exporter *e)
+{
+	if (!e || !e->used)
+		return;
+	if (fwrite(e->buf, 1, e->used, e->fp) != e->used)
+		fprintf(stderr, "[!] Unable to write the export\n");
+	fflush(e->fp);
+	e->used = 0;
+}
+
+static void put(struct exporter *e, char c)
+{
+	if (e->used == EXPORT_BUFFER_SIZE)
+		export_flush(e);
+	e->buf[e->used++] = c;
+}
+
+static void put_raw(struct exporter *e, const char *s)
+{
+	for (; *s; ++s)
+		put(e, *s);
+}
+
+static void put_uint(struct exporter *e, uint64_t v)
+{
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	while (n)
+		put(e, digits[--n]);
+}
+
+static void put_json_string(struct exporter *e, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	put(e, '"');
+	for (; *s; ++s) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			put(e, '\\');
+			put(e, c);
+		} else if (c == '\n') {
+			put_raw(e, "\\n");
+		} else if (c == '\t') {
+			put_raw(e, "\\t");
+		} else if (c < 0x20) {
+			put_raw(e, "\\u00");
+			put(e, hex[c >> 4]);
+			put(e, hex[c & 15]);
+		} else {
+			put(e, c);
+		}
+	}
+	put(e, '"');
+}
+
+static void put_csv_string(struct exporter *e, const char *s)
+{
+	if (!strpbrk(s, ",\"\r\n")) {
+		put_raw(e, s);
+		return;
+	}
+	put(e, '"');
+	for (; *s; ++s) {
+		if (*s == '"')
+			put(e, '"');
+		put(e, *s);
+	}
+	put(e, '"');
+}
+
+// every record has every column, in csv_header's order. JSON leaves out
+// the empty ones, CSV leaves the cell empty
+static void field_begin(struct exporter *e, const char *key)
+{
+	if (e->format == EXPORT_CSV) {
+		if (!e->first)
+			put(e, ',');
+	} else {
+		put_raw(e, e->first ? "{\"" : ",\"");
+		put_raw(e, key);
+		put_raw(e, "\":");
+	}
+	e->first = false;
+}
+
+static void field_str(struct exporter *e, const char *key, const char *value)
+{
+	if (!value || !*value) {
+		if (e->format == EXPORT_CSV)
+			field_begin(e, key);
+		return;
+	}
+	field_begin(e, key);
+	if (e->format == EXPORT_CSV)
+		put_csv_string(e, value);
+	else
+		put_json_string(e, value);
+}
+
+static void field_uint(struct exporter *e, const char *key, uint64_t value)
+{
+	field_begin(e, key);
+	put_uint(e, value);
+}
+
+static void field_empty(struct exporter *e, const char *key)
+{
+	if (e->format == EXPORT_CSV)
+		field_begin(e, key);
+}
+
+static void record_begin(struct exporter *e, const char *type)
+{
+	e->first = true;
+	field_str(e, "type", type);
+}
+
+static void record_end(struct exporter *e)
+{
+	if (e->format == EXPORT_JSONL)
+		put(e, '}');
+	put(e, '\n');
+}
+
+struct exporter *export_open(const char *path, export_format format)
+{
+	FILE *fp = fopen(path, "ab");
+	if (!fp) {
+		fprintf(stderr, "[!] Unable to open export file %s\n", path);
+		return NULL;
+	}
+	// our buffer is the only one
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	struct exporter *e = new struct exporter;
+	e->fp = fp;
+	e->format = format;
+	e->buf = (char*)malloc(EXPORT_BUFFER_SIZE);
+	e->used = 0;
+	e->first = true;
+
+	fseek(fp, 0, SEEK_END);
+	if (format == EXPORT_CSV && ftell(fp) == 0)
+		put_raw(e, csv_header);
+	return e;
+}
+
+void export_close(struct exporter *e)
+{
+	if (!e)
+		return;
+	export_flush(e);
+	fclose(e->fp);
+	free(e->buf);
+	delete e;
+}
+
+void export_track(struct exporter *e, const char *playlist, int position,
+	const char *track, const char *artist, const char *album, const char *album_uri,
+	bool available)
+{
+	if (!e)
+		return;
+	record_begin(e, "track");
+	field_str(e, "playlist", playlist);
+	field_uint(e, "position", position);
+	field_str(e, "track", track);
+	field_str(e, "artist", artist);
+	field_str(e, "album", album);
+	field_str(e, "album_uri", album_uri);
+	field_begin(e, "available");
+	put_raw(e, available ? "true" : "false");
+	field_empty(e, "year");
+	field_empty(e, "album_type");
+	field_empty(e, "image_id");
+	field_empty(e, "file");
+	field_empty(e, "bytes");
+	field_empty(e, "status");
+	field_empty(e, "reason");
+	record_end(e);
+}
+
+void export_album(struct exporter *e, const char *playlist, const char *album_uri,
+	const char *artist, const char *album, int year, const char *album_type,
+	const uint8_t *image_id, const char *file, size_t bytes, const char *status,
+	const char *reason)
+{
+	static const char hex[] = "0123456789abcdef";
+	if (!e)
+		return;
+	record_begin(e, "album");
+	field_str(e, "playlist", playlist);
+	field_empty(e, "position");
+	field_empty(e, "track");
+	field_str(e, "artist", artist);
+	field_str(e, "album", album);
+	field_str(e, "album_uri", album_uri);
+	field_empty(e, "available");
+	if (year > 0)
+		field_uint(e, "year", year);
+	else
+		field_empty(e, "year");
+	field_str(e, "album_type", album_type);
+	if (image_id) {
+		field_begin(e, "image_id");
+		if (e->format == EXPORT_JSONL)
+			put(e, '"');
+		for (int i = 0; i < 20; ++i) {
+			put(e, hex[image_id[i] >> 4]);
+			put(e, hex[image_id[i] & 15]);
+		}
+		if (e->format == EXPORT_JSONL)
+			put(e, '"');
+	} else {
+		field_empty(e, "image_id");
+	}
+	field_str(e, "file", file);
+	if (bytes)
+		field_uint(e, "bytes", bytes);
+	else
+		field_empty(e, "bytes");
+	field_str(e, "status", status);
+	field_str(e, "reason", reason);
+	record_end(e);
+}
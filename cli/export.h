@@ -0,0 +1,48 @@
+#ifndef SPOTIFART_EXPORT_H
+#define SPOTIFART_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Metadata export, a record per track and per album as the pipeline gets
+ * to it, for loading into whatever wants to know which cover belongs to
+ * which playlist.
+ *
+ * JSON Lines, one object per line with "type" set to "track" or "album",
+ * or CSV with a header line and the union of both records' columns, the
+ * ones a record doesn't have left empty:
+ *
+ *   type,playlist,position,track,artist,album,album_uri,available,
+ *   year,album_type,image_id,file,bytes,status,reason
+ *
+ * Records are formatted straight into one buffer allocated up front and
+ * written out when it fills up, so exporting doesn't add an allocation
+ * per track. Not thread safe, belongs to the fetcher thread like the
+ * journal. Every call accepts a NULL exporter and does nothing.
+ */
+enum export_format
+{
+	EXPORT_JSONL,
+	EXPORT_CSV
+};
+
+struct exporter;
+
+// NULL if the file can't be opened, appends to an existing file
+struct exporter *export_open(const char *path, export_format format);
+void export_close(struct exporter *e);
+
+// write out whatever is buffered
+void export_flush(struct exporter *e);
+
+void export_track(struct exporter *e, const char *playlist, int position,
+	const char *track, const char *artist, const char *album, const char *album_uri,
+	bool available);
+
+void export_album(struct exporter *e, const char *playlist, const char *album_uri,
+	const char *artist, const char *album, int year, const char *album_type,
+	const uint8_t *image_id, const char *file, size_t bytes, const char *status,
+	const char *reason);
+
+#endif
@@ -0,0 +1,1823 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#define strcasecmp _stricmp
+#endif
+
+// C++ headers
+#include <algorithm>
+#include <iostream>
+#include <ios>
+#include <sstream>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// C++11 headers
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include "fetcher.h"
+#include "catalog.h"
+#include "derive.h"
+#include "export.h"
+#include "job.h"
+#include "journal.h"
+#include "metrics.h"
+#include "optimize.h"
+#include "snapshot.h"
+#include "validate.h"
+#include "writer.h"
+#include "xmp.h"
+
+/**
+ * One album on its way through the pipeline: queued, album browse, cover
+ * image, maybe optimization, possibly waiting to be retried. Taken from the
+ * request pool on the fetcher thread when a track is dispatched and put
+ * back there once the album is finished. The track worker only touches it
+ * between popping it and issuing the browse.
+ */
+enum request_state
+{
+	REQ_QUEUED,
+	REQ_BROWSE,
+	REQ_IMAGE,
+	REQ_OPTIMIZE,
+	REQ_RETRY
+};
+
+// userdata of an album browse. A browse can't be cancelled, so when one
+// times out the ticket is orphaned (req = NULL) and cleaned up whenever
+// the late callback does arrive.
+struct browse_ticket
+{
+	struct request *req;
+};
+
+struct request
+{
+	struct job *job;
+	sp_track *track;
+	std::string uri;
+	const char *artist;		// interned, "" until the album browse is back
+	const char *album;
+	int year;			// 0 until the album browse is back
+	const char *album_type;		// "" until then too
+	byte image_id[20];		// valid once an image was asked for
+	std::atomic<int> state;
+	int position;			// of the first track, from 1
+	int fanout;			// tracks waiting on the album
+	uint64_t seq;			// order of arrival, breaks ties
+	int attempt;
+	std::atomic<int64_t> deadline;	// ms on the steady clock, while in flight
+	int64_t retry_at;
+	struct browse_ticket *ticket;
+	sp_image *image;
+	std::string reason;		// why the last attempt failed
+	bool permanent;			// and retrying won't change that
+	std::vector<struct job*> waiters;	// a duplicate track each, done when this is
+};
+
+// retry backoff, doubling from the base up to the cap, with jitter
+#define RETRY_BASE_MS 1000
+#define RETRY_CAP_MS 60000
+
+// how far past the cursor to look for tracks that loaded out of order
+#define TRACK_LOOKAHEAD 256
+
+// albums handed to the track worker ahead of time, the rest wait their
+// turn in the heap. The worker issues one browse per 10 ms tick
+#define TRACK_QUEUE_DEPTH 8
+
+// requests allocated at a time
+#define REQUEST_SLAB_SIZE 256
+
+fetcher_config::fetcher_config()
+	: appkey(NULL), appkey_size(0),
+	cache_location("sp_tmp"), settings_location("sp_tmp"), cache_size(-1),
+	max_jobs(4), request_timeout(30), max_attempts(4), drain_seconds(15),
+	order(ORDER_POSITION),
+	layout(LAYOUT_FLAT), sync_mode(DURABLE_NONE), sync_batch(64), optimize_threads(0),
+	derive_threads(0), embed_metadata(false),
+	snapshot_dir(NULL), watch(false), prewarm(false), verbose(false), shard_index(0), shard_count(1), journal(NULL),
+	exporter(NULL), catalog(NULL)
+{
+}
+
+static std::string album_uri(sp_album *album)
+{
+	char buf[64] = "";
+	sp_link *link = sp_link_create_from_album(album);
+	if (link) {
+		sp_link_as_string(link, buf, sizeof(buf));
+		sp_link_release(link);
+	}
+	return buf;
+}
+
+static const char *album_type_name(sp_albumtype type)
+{
+	switch (type) {
+	case SP_ALBUMTYPE_ALBUM: return "album";
+	case SP_ALBUMTYPE_SINGLE: return "single";
+	case SP_ALBUMTYPE_COMPILATION: return "compilation";
+	default: return "unknown";
+	}
+}
+
+static const char *album_status_name(album_status status)
+{
+	switch (status) {
+	case ALBUM_WRITTEN: return "written";
+	case ALBUM_CACHED: return "cached";
+	case ALBUM_UNAVAILABLE: return "unavailable";
+	default: return "failed";
+	}
+}
+
+static int64_t now_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char *request_name(struct request *req)
+{
+	return *req->album ? req->album : req->uri.c_str();
+}
+
+// retrying won't help with these
+static bool error_retryable(sp_error err)
+{
+	switch (err) {
+	case SP_ERROR_OTHER_PERMANENT:
+	case SP_ERROR_INVALID_INDATA:
+	case SP_ERROR_PERMISSION_DENIED:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static bool create_dir(const char *path)
+{
+	int ret = 0;
+	struct stat st = {};
+	stat(path, &st);
+	if (st.st_mode & S_IFDIR)
+		return true;
+
+#ifdef _WIN32
+	if (!CreateDirectoryA(path, NULL))
+		ret = -1;
+#else
+	ret = mkdir(path, 0777);
+#endif
+
+	if (-1 == ret) {
+		fprintf(stderr, "Error creating directory %s\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// FNV-1a, stable across processes and runs
+static uint32_t fnv1a(const std::string &s)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < s.size(); ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// the characters an alpha layout directory can be named by
+static const char alpha_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+
+static char alpha_char(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+		return c;
+	return '_';
+}
+
+/**
+ * Where a cover goes under outdir.
+ *   flat:  Artist - Album.jpg
+ *   alpha: a/ar/Artist - Album.jpg, by the first two characters of the artist,
+ *          or _/_x/ by a hash of the first character if it isn't ASCII
+ *   hash:  3/3f/Artist - Album.jpg, by a hash of the file name
+ */
+static std::string cover_path(const std::string &outdir, output_layout layout,
+	const char *artist, const char *album)
+{
+	std::string name = std::string(artist) + " - " + album + ".jpg";
+	std::string sub;
+
+	if (layout == LAYOUT_ALPHA) {
+		char a = alpha_char(artist[0]);
+		char b = artist[0] ? alpha_char(artist[1]) : '_';
+
+		// a name in another script would all land in _/__, so spread
+		// them under _ by a hash of their first (UTF-8) character
+		if ((unsigned char)artist[0] >= 0x80) {
+			unsigned char lead = (unsigned char)artist[0];
+			size_t len = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+			len = strnlen(artist, len);
+			b = alpha_chars[fnv1a(std::string(artist, len)) % (sizeof(alpha_chars) - 1)];
+		}
+		sub += a;
+		sub += '/';
+		sub += a;
+		sub += b;
+		sub += '/';
+	} else if (layout == LAYOUT_HASH) {
+		uint32_t h = fnv1a(name);
+		sub += hex_digits[(h >> 28) & 0xf];
+		sub += '/';
+		sub += hex_digits[(h >> 28) & 0xf];
+		sub += hex_digits[(h >> 24) & 0xf];
+		sub += '/';
+	}
+	return outdir + "/" + sub + name;
+}
+
+// create every directory of the layout now, so writing a cover never has to
+static bool layout_create(const std::string &outdir, output_layout layout)
+{
+	const char *chars = layout == LAYOUT_ALPHA ? alpha_chars : hex_digits;
+	size_t n = strlen(chars);
+
+	for (size_t i = 0; i < n && layout != LAYOUT_FLAT; ++i) {
+		std::string top = outdir + "/" + chars[i];
+		if (!create_dir(top.c_str()))
+			return false;
+		for (size_t j = 0; j < n; ++j) {
+			std::string dir = top + "/" + chars[i] + chars[j];
+			if (!create_dir(dir.c_str()))
+				return false;
+		}
+	}
+	return true;
+}
+
+static job_result make_result(struct job *job, job_status status)
+{
+	job_result r;
+	r.id = job->id;
+	r.source = job->source;
+	r.outdir = job->outdir;
+	r.status = status;
+	r.error = job->error;
+	r.covers = job->covers;
+	r.duplicates = job->duplicates;
+	r.unavailable = job->unavailable;
+	r.failed = job->failed;
+	return r;
+}
+
+static void SP_CALLCONV logged_out(sp_session *session)
+{
+	//g_logged_out = 1;
+}
+
+CoverFetcher::CoverFetcher(const fetcher_config &cfg)
+	: config(cfg), session(NULL), spconfig(), session_callbacks(),
+	pc_callbacks(), pl_skim_callbacks(), pl_scan_callbacks(),
+	logged_in(false), login_failed(false), container(NULL),
+	container_loaded(false), quit(false), quit_now(false), notify_do(0),
+	track_queue(TRACK_QUEUE_DEPTH), track_heap_dirty(false), track_seq(0), track_queued(0),
+	track_waiting(0), track_worker_run(false), pending_closed(false), next_job_id(1),
+	todo_items(0), inflight(0), request_pool(REQUEST_SLAB_SIZE)
+{
+	pc_callbacks.container_loaded = container_loaded_cb;
+
+	// the skim callbacks are only there to learn playlist names
+	pl_skim_callbacks.playlist_metadata_updated = skim_metadata_updated_cb;
+
+	pl_scan_callbacks.playlist_state_changed = scan_state_changed_cb;
+	pl_scan_callbacks.tracks_added = tracks_added_cb;
+	pl_scan_callbacks.tracks_removed = tracks_removed_cb;
+	pl_scan_callbacks.tracks_moved = tracks_moved_cb;
+	pl_scan_callbacks.playlist_metadata_updated = scan_metadata_updated_cb;
+
+	session_callbacks.logged_in = logged_in_cb;
+	session_callbacks.logged_out = logged_out;
+	session_callbacks.connection_error = connection_error_cb;
+	session_callbacks.notify_main_thread = notify_main_thread_cb;
+	session_callbacks.log_message = log_message_cb;
+
+	spconfig.api_version = SPOTIFY_API_VERSION;
+	spconfig.cache_location = config.cache_location;
+	spconfig.settings_location = config.settings_location;
+	spconfig.application_key = config.appkey;
+	spconfig.application_key_size = config.appkey_size;
+	spconfig.user_agent = "spotifart";
+	spconfig.callbacks = &session_callbacks;
+	spconfig.userdata = this;
+
+	out = writer_open(config.sync_mode, config.sync_batch);
+	optimizer = NULL;
+	if (config.optimize_threads > 0)
+		optimizer = optimizer_open(config.optimize_threads, [this] { notify(); });
+	deriver = NULL;
+	if (!config.derivatives.empty())
+		deriver = deriver_open(config.derivatives, config.derive_threads);
+}
+
+CoverFetcher::~CoverFetcher()
+{
+	// jobs still queued when run() returned never started
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		pending_closed = true;
+		for (size_t i = 0; i < pending_jobs.size(); ++i) {
+			if (pending_jobs[i]->done)
+				pending_jobs[i]->done(make_result(pending_jobs[i], JOB_INTERRUPTED));
+			delete pending_jobs[i];
+		}
+		pending_jobs.clear();
+	}
+
+	if (session) {
+		sp_session_logout(session);
+		sp_session_release(session);
+	}
+	optimizer_close(optimizer);
+	writer_close(out);
+	deriver_close(deriver);
+}
+
+bool CoverFetcher::open()
+{
+	sp_error err = sp_session_create(&spconfig, &session);
+	if (SP_ERROR_OK != err) {
+		fprintf(stderr, "[!] Unable to create session: %s\n",
+			sp_error_message(err));
+		session = NULL;
+		return false;
+	}
+
+	if (config.cache_size >= 0) {
+		err = sp_session_set_cache_size(session, (size_t)config.cache_size);
+		if (SP_ERROR_OK != err) {
+			fprintf(stderr, "[!] Unable to set cache size: %s\n",
+				sp_error_message(err));
+			metrics_error(err);
+		}
+	}
+	return true;
+}
+
+bool CoverFetcher::relogin(const char *username)
+{
+	char remembered[256];
+	int len = sp_session_remembered_user(session, remembered, sizeof(remembered));
+	if (len <= 0 || (username && strcasecmp(username, remembered)))
+		return false;
+
+	sp_error err = sp_session_relogin(session);
+	if (err != SP_ERROR_OK) {
+		fprintf(stderr, "[!] Relogin failed: %s\n", sp_error_message(err));
+		metrics_error(err);
+		return false;
+	}
+	printf("[*] Logging in as remembered user %s\n", remembered);
+	return true;
+}
+
+bool CoverFetcher::login(const char *username, const char *password, bool remember)
+{
+	sp_error err = sp_session_login(session, username, password, remember, NULL);
+	if (err != SP_ERROR_OK) {
+		fprintf(stderr, "[!] Login failed: %s\n", sp_error_message(err));
+		metrics_error(err);
+		return false;
+	}
+	return true;
+}
+
+void CoverFetcher::notify()
+{
+	std::unique_lock<std::mutex> lock(notify_mutex);
+	notify_do = 1;
+	notify_cond.notify_all();
+}
+
+void CoverFetcher::stop()
+{
+	if (quit)
+		quit_now = true;
+	quit = true;
+}
+
+// adjust the outstanding item count of a job, n may be negative
+void CoverFetcher::job_add_items(struct job *job, int n)
+{
+	job->todo += n;
+	todo_items += n;
+}
+
+// one track of the job is done, one way or another
+void CoverFetcher::job_item_done(struct job *job)
+{
+	job_add_items(job, -1);
+	metrics_progress();
+}
+
+// an album that went down the pipeline has come back out
+void CoverFetcher::album_done(struct request *req, album_status status,
+	const std::string &filename, size_t bytes)
+{
+	struct job *job = req->job;
+	album_key key(req->uri, job->outdir);
+	albums_pending.erase(key);
+
+	// a failure retrying might fix leaves it to the next track (or job)
+	// that wants the album, anything else is the answer for this run
+	bool covered = status == ALBUM_WRITTEN || status == ALBUM_CACHED;
+	if (status == ALBUM_FAILED && !req->permanent)
+		albums_seen.erase(key);
+	else
+		albums_seen[key] = status;
+
+	export_album(config.exporter, job->source.c_str(), req->uri.c_str(), req->artist,
+		req->album, req->year, req->album_type,
+		status == ALBUM_WRITTEN ? req->image_id : NULL, filename.c_str(), bytes,
+		album_status_name(status), status == ALBUM_FAILED ? req->reason.c_str() : "");
+	if (*req->album)
+		catalog_album(config.catalog, req->uri.c_str(), req->album, req->artist, req->year,
+			status == ALBUM_WRITTEN ? req->image_id : NULL, filename.c_str(), bytes);
+
+	// no cover, so the next run should try again
+	if (!covered)
+		snapshot_drop(job->snapshot, req->uri);
+
+	// duplicate tracks waited to share the outcome
+	for (size_t i = 0; i < req->waiters.size(); ++i) {
+		struct job *waiter = req->waiters[i];
+		if (covered) {
+			waiter->duplicates++;
+		} else {
+			if (status == ALBUM_UNAVAILABLE)
+				waiter->unavailable++;
+			else
+				waiter->failed++;
+			snapshot_drop(waiter->snapshot, req->uri);
+		}
+		job_item_done(waiter);
+	}
+
+	if (job->on_album) {
+		album_result r;
+		r.source = job->source;
+		r.outdir = job->outdir;
+		r.uri = req->uri;
+		r.artist = req->artist;
+		r.album = req->album;
+		r.filename = filename;
+		r.bytes = bytes;
+		r.attempts = req->attempt + (status == ALBUM_FAILED ? 0 : 1);
+		r.reason = req->reason;
+		r.status = status;
+		job->on_album(r);
+	}
+
+	inflight--;
+	requests.erase(req);
+	sp_track_release(req->track);
+	names.release(req->album);
+	names.release(req->artist);
+	request_pool.put(req);
+	job_item_done(job);
+}
+
+/**
+ * The current attempt at an album failed. Schedule another one after a
+ * jittered exponential backoff, or give up once it has had max_attempts.
+ */
+void CoverFetcher::request_fail(struct request *req, const std::string &reason, bool retry)
+{
+	req->reason = reason;
+	req->permanent = !retry;
+	req->attempt++;
+
+	if (!retry || req->attempt >= config.max_attempts) {
+		std::stringstream ss;
+		ss << req->job->source << ": ";
+		if (*req->album)
+			ss << req->artist << " - " << req->album << " ";
+		ss << req->uri << ": " << reason << ", " << req->attempt
+			<< (req->attempt == 1 ? " attempt" : " attempts");
+		failure_list.push_back(ss.str());
+		fprintf(stderr, "[!] Giving up on %s\n", ss.str().c_str());
+		req->job->failed++;
+		album_done(req, ALBUM_FAILED, "", 0);
+		return;
+	}
+
+	int64_t backoff = (int64_t)RETRY_BASE_MS << (req->attempt - 1);
+	if (backoff > RETRY_CAP_MS)
+		backoff = RETRY_CAP_MS;
+	backoff = backoff / 2 + rand() % (backoff / 2 + 1);
+
+	fprintf(stderr, "[!] %s: %s, retrying in %d ms\n", request_name(req),
+		reason.c_str(), (int)backoff);
+	req->retry_at = now_ms() + backoff;
+	req->deadline = 0;
+	req->state = REQ_RETRY;
+	inflight--;
+}
+
+// expire requests past their deadline, requeue due retries
+void CoverFetcher::requests_service()
+{
+	int64_t now = now_ms();
+	std::vector<struct request*> expired;
+	std::vector<struct request*> due;
+
+	std::set<struct request*>::iterator it;
+	for (it = requests.begin(); it != requests.end(); ++it) {
+		struct request *req = *it;
+		int state = req->state.load();
+		int64_t deadline = req->deadline.load();
+		if ((state == REQ_BROWSE || state == REQ_IMAGE) && deadline && now > deadline)
+			expired.push_back(req);
+		else if (state == REQ_RETRY && now >= req->retry_at && !quit.load())
+			due.push_back(req);
+	}
+
+	for (size_t i = 0; i < expired.size(); ++i) {
+		struct request *req = expired[i];
+		if (req->state == REQ_BROWSE) {
+			req->ticket->req = NULL;
+			req->ticket = NULL;
+			g_metrics.browses_inflight--;
+		} else {
+			sp_image_remove_load_callback(req->image, image_cb, req);
+			sp_image_release(req->image);
+			req->image = NULL;
+			g_metrics.images_inflight--;
+		}
+		metrics_error(SP_ERROR_OTHER_TRANSIENT);
+		request_fail(req, "timed out", true);
+	}
+
+	for (size_t i = 0; i < due.size(); ++i) {
+		due[i]->state = REQ_QUEUED;
+		track_enqueue(due[i]);
+	}
+
+	track_feed();
+}
+
+// true if a should be browsed before b
+static bool track_before(dispatch_order order, const struct request *a,
+	const struct request *b)
+{
+	switch (order) {
+	case ORDER_FANOUT:
+		if (a->fanout != b->fanout)
+			return a->fanout > b->fanout;
+		// fall through
+	case ORDER_POSITION:
+		if (a->position != b->position)
+			return a->position < b->position;
+		break;
+	case ORDER_FIFO:
+		break;
+	}
+	return a->seq < b->seq;
+}
+
+// std heaps keep the greatest on top, so "less" is "after"
+struct track_after
+{
+	dispatch_order order;
+	explicit track_after(dispatch_order o) : order(o) {}
+	bool operator()(const struct request *a, const struct request *b) const
+	{
+		return track_before(order, b, a);
+	}
+};
+
+// line an album up for the track worker. Retries keep their place
+void CoverFetcher::track_enqueue(struct request *req)
+{
+	g_metrics.queue_depth++;
+	track_heap.push_back(req);
+	std::push_heap(track_heap.begin(), track_heap.end(), track_after(config.order));
+}
+
+// top up the track worker's queue with the best albums waiting
+void CoverFetcher::track_feed()
+{
+	track_after after(config.order);
+	if (track_heap_dirty) {
+		std::make_heap(track_heap.begin(), track_heap.end(), after);
+		track_heap_dirty = false;
+	}
+	while (!track_heap.empty() && track_queued.load() < TRACK_QUEUE_DEPTH) {
+		std::pop_heap(track_heap.begin(), track_heap.end(), after);
+		track_queued++;
+		if (!track_queue.push(track_heap.back())) {
+			track_queued--;
+			std::push_heap(track_heap.begin(), track_heap.end(), after);
+			break;
+		}
+		track_heap.pop_back();
+	}
+	track_waiting = (int)track_heap.size();
+}
+
+// TODO file name handling needs to be done in unicode
+// TODO certain filenames don't get created in windows (colon in name)
+void SP_CALLCONV CoverFetcher::image_cb(sp_image *image, void *userdata)
+{
+	struct request *req = (struct request*)userdata;
+	struct job *job = req->job;
+	CoverFetcher *self = job->fetcher;
+	const char *str_artist = req->artist;
+	const char *str_album = req->album;
+
+	g_metrics.images_inflight--;
+	sp_image_remove_load_callback(image, image_cb, req);
+	req->image = NULL;
+
+	sp_error err = sp_image_error(image);
+	if (err != SP_ERROR_OK) {
+		fprintf(stderr, "[!] Image load failed for %s - %s: %s\n",
+			str_artist, str_album, sp_error_message(err));
+		metrics_error(err);
+		sp_image_release(image);
+		self->request_fail(req, std::string("image: ") + sp_error_message(err),
+			error_retryable(err));
+		return;
+	}
+
+	size_t len;
+	const void * data = sp_image_data(image, &len);
+	sp_imageformat format = sp_image_format(image);
+	if (format != SP_IMAGE_FORMAT_JPEG)
+	{
+		fprintf(stderr, "[!] Unsupported image format for %s - %s: %d\n",
+			str_artist, str_album, format);
+		g_metrics.images_invalid++;
+		sp_image_release(image);
+		self->request_fail(req, "unsupported image format", false);
+		return;
+	}
+
+	// a short or mangled download is worth another go, anything that
+	// isn't a JPEG at all won't get better
+	const char *why;
+	jpeg_check check = jpeg_validate(data, len, &why);
+	if (check != JPEG_OK) {
+		fprintf(stderr, "[!] Bad image for %s - %s: %s\n", str_artist, str_album, why);
+		g_metrics.images_invalid++;
+		sp_image_release(image);
+		self->request_fail(req, std::string("bad image: ") + why, check == JPEG_BROKEN);
+		return;
+	}
+
+	if (self->optimizer) {
+		req->state = REQ_OPTIMIZE;
+		optimizer_put(self->optimizer, req, data, len);
+	} else {
+		self->cover_write(req, data, len);
+	}
+	sp_image_release(image);
+}
+
+void CoverFetcher::cover_write(struct request *req, const void *data, size_t len)
+{
+	struct job *job = req->job;
+	std::string filename = cover_path(job->outdir, config.layout,
+		req->artist, req->album);
+
+	// the metadata segment goes in between the JFIF header and the rest,
+	// straight from the image's own buffer
+	write_part parts[3];
+	int nparts = 0;
+	std::string xmp;
+	size_t at = config.embed_metadata ? xmp_offset(data, len) : 0;
+	if (at) {
+		cover_meta meta;
+		meta.artist = req->artist;
+		meta.album = req->album;
+		meta.uri = req->uri.c_str();
+		meta.year = req->year;
+		meta.image_id = req->image_id;
+		xmp = xmp_segment(meta);
+	}
+	if (!xmp.empty()) {
+		parts[0].data = data;
+		parts[0].len = at;
+		parts[1].data = xmp.data();
+		parts[1].len = xmp.size();
+		parts[2].data = (const char*)data + at;
+		parts[2].len = len - at;
+		nparts = 3;
+		len += xmp.size();
+	} else {
+		parts[0].data = data;
+		parts[0].len = len;
+		nparts = 1;
+	}
+
+	std::cout << "[+] Writing " << filename << " --- " << len << " bytes" << std::endl;
+
+	// the journal only hears about it once it is on disk as asked, and
+	// derivatives are made from the file in place. A batch commit can
+	// still lose it, after the album was done: take back what it counted.
+	// Jobs wait for the commit before retiring, so job and the waiters,
+	// which album_done() counts as duplicates, are still there
+	std::string uri = req->uri;
+	std::vector<struct job*> waiters = req->waiters;
+	bool written = writer_putv(out, filename, parts, nparts,
+		[this, job, waiters, uri, filename, len](bool ok) {
+			if (ok) {
+				g_metrics.covers_written++;
+				g_metrics.bytes_written += len;
+				journal_album_done(config.journal, job->outdir, uri);
+				deriver_put(deriver, filename);
+				return;
+			}
+			failure_list.push_back(job->source + ": unable to write " + filename);
+			albums_seen.erase(album_key(uri, job->outdir));
+			snapshot_drop(job->snapshot, uri);
+			job->covers--;
+			job->failed++;
+			for (size_t i = 0; i < waiters.size(); ++i) {
+				snapshot_drop(waiters[i]->snapshot, uri);
+				waiters[i]->duplicates--;
+				waiters[i]->failed++;
+			}
+		});
+
+	if (!written) {
+		fprintf(stderr, "[!] Unable to write %s\n", filename.c_str());
+		request_fail(req, "unable to write " + filename, false);
+		return;
+	}
+
+	job->covers++;
+	album_done(req, ALBUM_WRITTEN, filename, len);
+}
+
+// write whatever the optimizer pool has finished
+void CoverFetcher::optimize_service()
+{
+	if (!optimizer)
+		return;
+
+	optimized item;
+	while (optimizer_get(optimizer, item)) {
+		struct request *req = (struct request*)item.tag;
+		if (item.changed) {
+			g_metrics.bytes_saved += item.original - item.data.size();
+			if (config.verbose)
+				printf("[~] Optimized %s - %s: %u -> %u bytes\n", req->artist, req->album,
+					(unsigned int)item.original, (unsigned int)item.data.size());
+		}
+		cover_write(req, item.data.empty() ? NULL : &item.data[0], item.data.size());
+	}
+}
+
+int CoverFetcher::get_album_image(struct request *req, sp_album* album)
+{
+	// can be SP_IMAGE_SMALL, _NORMAL, or _LARGE
+	const byte * image_id = sp_album_cover(album, SP_IMAGE_SIZE_NORMAL);
+
+	sp_image *image = image_id ? sp_image_create(session, image_id) : NULL;
+	if (image == NULL)
+	{
+		fprintf(stderr, "[!] Album cover not available for %s - %s\n",
+			req->artist, req->album);
+		return -1;
+	}
+
+	memcpy(req->image_id, image_id, sizeof(req->image_id));
+	req->image = image;
+	req->state = REQ_IMAGE;
+	req->deadline = now_ms() + config.request_timeout * 1000;
+
+	g_metrics.images_total++;
+	g_metrics.images_inflight++;
+	sp_image_add_load_callback(image, image_cb, (void*)req);
+	return 0;
+}
+
+// this will service on the fetcher thread
+void SP_CALLCONV CoverFetcher::album_cb(sp_albumbrowse *result, void *userdata)
+{
+	struct browse_ticket *ticket = (struct browse_ticket*)userdata;
+	struct request *req = ticket->req;
+	delete ticket;
+
+	// timed out already and retried or given up on, nothing left to do
+	if (!req) {
+		sp_albumbrowse_release(result);
+		return;
+	}
+	req->ticket = NULL;
+
+	struct job *job = req->job;
+	CoverFetcher *self = job->fetcher;
+
+	g_metrics.browses_inflight--;
+
+	sp_error err = sp_albumbrowse_error(result);
+	if (err != SP_ERROR_OK) {
+		metrics_error(err);
+		sp_albumbrowse_release(result);
+		self->request_fail(req, std::string("album browse: ") + sp_error_message(err),
+			error_retryable(err));
+		return;
+	}
+
+	sp_album *album = sp_albumbrowse_album(result);
+	if (!album) {
+		fprintf(stderr, "[!] WTF - null album pointer in the album browse callback\n");
+		sp_albumbrowse_release(result);
+		self->request_fail(req, "album browse: no album", true);
+		return;
+	}
+	// copies, the browse (and with it the album) is released below.
+	// A retry browses again, so drop what the last attempt took
+	sp_artist *artist = sp_album_artist(album);
+	self->names.release(req->album);
+	self->names.release(req->artist);
+	req->album = self->names.intern(sp_album_name(album));
+	req->artist = self->names.intern(sp_artist_name(artist));
+	req->year = sp_album_year(album);
+	req->album_type = album_type_name(sp_album_type(album));
+
+	// TODO I had retries here to wait for the album to become available
+	// but that was pointless... need to move this to another thread to allow
+	// main thread to work (I think)
+	if (!sp_album_is_available(album)) {
+		fprintf(stderr, "[!] Album not available: %s - %s\n",
+				req->artist, req->album);
+		sp_albumbrowse_release(result);
+		job->unavailable++;
+		self->album_done(req, ALBUM_UNAVAILABLE, "", 0);
+		return;
+	}
+
+	// pre-warm runs stop here, the album metadata is in the cache now.
+	// It counts as the album's cover, the one this run brings in
+	if (self->config.prewarm) {
+		sp_albumbrowse_release(result);
+		job->covers++;
+		self->album_done(req, ALBUM_CACHED, "", 0);
+		return;
+	}
+
+	// TODO offload to a background worker?
+	// seems unnecessary as the track worker will throttle the overall flow
+	if (self->get_album_image(req, album) < 0)
+		self->request_fail(req, "no cover image", false);
+	sp_albumbrowse_release(result);
+}
+
+/**
+ * Service the track queue on a background thread.
+ *
+ * The whole point of this worker thread is to stare down the track queue (lame)
+ * and issue album browse requests periodically. Performance was awful when issuing
+ * several hundred album browse requests, and they would start failing as well. So
+ * throttling back like this seems to work well. I guess I could do it in the main thread
+ * but I wrote it when I wasn't sure what was going on with main. It _is_ the callback
+ * thread, apparently. The docs at developer.spotify.com had me thinking it was a
+ * library thread.
+ */
+void CoverFetcher::track_work()
+{
+	struct request *req;
+	while (track_worker_run.load()) {
+		// no new requests once stop() asked us to drain
+		if (!quit.load() && track_queue.pop(req)) {
+			g_metrics.queue_depth--;
+
+			// running low, have run() top it up
+			if (--track_queued <= TRACK_QUEUE_DEPTH / 2 && track_waiting.load() > 0)
+				notify();
+
+			struct browse_ticket *ticket = new struct browse_ticket;
+			ticket->req = req;
+			req->ticket = ticket;
+			req->state = REQ_BROWSE;
+			req->deadline = now_ms() + config.request_timeout * 1000;
+			inflight++;
+
+			// the browse is released in album_cb
+			sp_album *album = sp_track_album(req->track);
+			sp_albumbrowse_create(session, album, &album_cb, ticket);
+			g_metrics.browses_total++;
+			g_metrics.browses_inflight++;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+// every process has to put an album in the same shard
+static unsigned int album_shard(const std::string &uri, int shards)
+{
+	return fnv1a(uri) % (uint32_t)shards;
+}
+
+// hand a loaded track to the album pipeline (or write it off)
+void CoverFetcher::dispatch_track(struct job *job, int index, sp_track *t)
+{
+	sp_album *album = sp_track_album(t);
+	sp_artist *artist = sp_track_num_artists(t) > 0 ? sp_track_artist(t, 0) : NULL;
+	std::string uri = album_uri(album);
+	if (config.watch)
+		job->albums.insert(uri);
+
+	// every shard sees every track, the first one catalogs them
+	if (config.shard_index == 0)
+		catalog_track(config.catalog, job->source.c_str(), index + 1, sp_track_name(t),
+			artist ? sp_artist_name(artist) : "", uri.c_str());
+
+	// another shard owns this album, and counts the track too
+	if (config.shard_count > 1 &&
+		album_shard(uri, config.shard_count) != (unsigned int)config.shard_index) {
+		job_item_done(job);
+		return;
+	}
+
+	bool available = sp_track_get_availability(session, t) ==
+		SP_TRACK_AVAILABILITY_AVAILABLE;
+	export_track(config.exporter, job->source.c_str(), index + 1, sp_track_name(t),
+		artist ? sp_artist_name(artist) : "", album ? sp_album_name(album) : "",
+		uri.c_str(), available);
+
+	// the last run got this one, it never goes near the track worker
+	if (snapshot_has(job->snapshot, uri)) {
+		snapshot_add(job->snapshot, uri);
+		job->duplicates++;
+		job_item_done(job);
+		return;
+	}
+
+	if (!available) {
+		fprintf(stderr, "[!] Track %d: %s is not available\n",
+			index+1, sp_track_name(t));
+		job->unavailable++;
+		job_item_done(job);
+		return;
+	}
+
+	album_key key(uri, job->outdir);
+	snapshot_add(job->snapshot, uri);
+
+	// another track is bringing this cover in, count this one when it lands
+	std::map<album_key, struct request*>::iterator pending = albums_pending.find(key);
+	if (pending != albums_pending.end()) {
+		struct request *req = pending->second;
+		req->waiters.push_back(job);
+		if (config.order == ORDER_FANOUT &&
+			(req->state == REQ_QUEUED || req->state == REQ_RETRY)) {
+			req->fanout++;
+			track_heap_dirty = true;
+		}
+		return;
+	}
+
+	std::map<album_key, album_status>::iterator seen = albums_seen.find(key);
+	if (seen != albums_seen.end() && seen->second == ALBUM_UNAVAILABLE) {
+		job->unavailable++;
+		snapshot_drop(job->snapshot, uri);
+		job_item_done(job);
+	} else if (seen != albums_seen.end() && seen->second == ALBUM_FAILED) {
+		// gave up for good earlier in the run, no point asking again
+		job->failed++;
+		snapshot_drop(job->snapshot, uri);
+		job_item_done(job);
+	} else if (seen != albums_seen.end() ||
+		journal_has_album(config.journal, key.second, key.first)) {
+		// some other track (or an earlier run) already brought this cover in
+		if (seen == albums_seen.end())
+			albums_seen[key] = ALBUM_WRITTEN;
+		job->duplicates++;
+		job_item_done(job);
+	} else {
+		albums_seen[key] = ALBUM_WRITTEN;
+		// add reference to track and queue it for the track worker
+		sp_track_add_ref(t);
+		struct request *req = request_pool.get();
+		req->job = job;
+		req->track = t;
+		req->uri = key.first;
+		req->artist = "";
+		req->album = "";
+		req->year = 0;
+		req->album_type = "";
+		req->state = REQ_QUEUED;
+		req->position = index + 1;
+		req->fanout = 1;
+		req->seq = track_seq++;
+		req->attempt = 0;
+		req->deadline = 0;
+		req->retry_at = 0;
+		req->ticket = NULL;
+		req->image = NULL;
+		req->reason.clear();
+		req->permanent = false;
+		req->waiters.clear();
+		requests.insert(req);
+		albums_pending[key] = req;
+		track_enqueue(req);
+#if 0
+		printf("[+] Track %d: %s - %s\n", index+1,
+			sp_artist_name(sp_track_artist(t, 0)),
+			sp_track_name(t));
+#endif
+	}
+}
+
+// mark track i loaded and dispatch it, returns false if it isn't yet
+bool CoverFetcher::track_ready(struct job *job, int i)
+{
+	if (job->track_loaded[i])
+		return true;
+	sp_track *t = sp_playlist_track(job->playlist, i);
+	if (!t || !sp_track_is_loaded(t))
+		return false;
+	job->track_loaded[i] = true;
+	job->tracks_loaded++;
+	job->last_progress = now_ms();
+	dispatch_track(job, i, t);
+	return true;
+}
+
+/**
+ * Dispatch every track that has loaded since the last metadata update.
+ *
+ * Tracks go to the album pipeline as soon as they load, so covers start
+ * arriving while the tail of a big playlist is still coming in. Each track
+ * counts as one todo item from the moment the playlist is first seen, and
+ * is dispatched exactly once, which keeps the completion count exact.
+ */
+void CoverFetcher::playlist_browse_try(struct job *job)
+{
+	sp_playlist_add_ref(job->playlist);
+	sp_playlist *pl = job->playlist;
+
+	// printf("[*] Browsing playlist %s\n", sp_playlist_name(pl));
+
+	if (!sp_playlist_is_loaded(pl)) {
+		fprintf(stderr, "[!] Playlist %s not loaded yet\n", sp_playlist_name(pl));
+		sp_playlist_release(pl);
+		return;
+	}
+
+	int tracks = sp_playlist_num_tracks(pl);
+	int known = (int)job->track_loaded.size();
+
+	// the first sighting replaces the placeholder todo item, after that
+	// the track count can still change while the playlist is loading
+	if (known == 0 && job->tracks_loaded == 0) {
+		job_add_items(job, tracks - 1);
+	} else if (tracks > known) {
+		job_add_items(job, tracks - known);
+	} else if (tracks < known) {
+		// forget tracks that vanished before they were dispatched
+		for (int i = tracks; i < known; ++i) {
+			if (job->track_loaded[i])
+				job->tracks_loaded--;
+			else
+				job_add_items(job, -1);
+		}
+		if (job->track_cursor > tracks)
+			job->track_cursor = tracks;
+	}
+	job->track_loaded.resize(tracks, false);
+
+	// pick up where the last update stopped instead of rescanning from
+	// the top, every track is checked once after it loads
+	while (job->track_cursor < tracks && track_ready(job, job->track_cursor))
+		job->track_cursor++;
+
+	// then peek a little further so a slow track doesn't hold up the rest
+	int end = job->track_cursor + TRACK_LOOKAHEAD;
+	if (end > tracks)
+		end = tracks;
+	for (int i = job->track_cursor + 1; i < end; ++i)
+		track_ready(job, i);
+
+	if (job->tracks_loaded == tracks) {
+		job->loaded = true;
+		if (!job->watching)
+			printf("[*] Playlist loaded: %s\n", sp_playlist_name(pl));
+		job->watching = config.watch;
+	}
+
+	sp_playlist_release(pl);
+}
+
+// a playlist can come straight out of the cache fully loaded, in which
+// case no metadata update will ever arrive
+void SP_CALLCONV CoverFetcher::scan_state_changed_cb(sp_playlist *pl, void *userdata)
+{
+	scan_metadata_updated_cb(pl, userdata);
+}
+
+void SP_CALLCONV CoverFetcher::scan_metadata_updated_cb(sp_playlist *pl, void *userdata)
+{
+	struct job *job = (struct job*)userdata;
+
+	// don't try to browse the playlist again if we've already successfully
+	// browsed once... (this callback will keep firing after we've moved on to
+	// other things)
+	if (job->loaded)
+		return;
+
+	job->fetcher->playlist_browse_try(job);
+}
+
+/**
+ * Tracks were inserted at position. Until the playlist has loaded in full
+ * playlist_browse_try() counts them, after that (watch mode only) they
+ * get a slot each in track_loaded and are dispatched as they load.
+ */
+void SP_CALLCONV CoverFetcher::tracks_added_cb(sp_playlist *pl, sp_track *const *tracks,
+	int num_tracks, int position, void *userdata)
+{
+	struct job *job = (struct job*)userdata;
+	printf("[*] %d tracks added to %s\n", num_tracks, sp_playlist_name(pl));
+	if (!job->watching)
+		return;
+
+	if (position > (int)job->track_loaded.size())
+		position = (int)job->track_loaded.size();
+	job->track_loaded.insert(job->track_loaded.begin() + position, num_tracks, false);
+	if (job->track_cursor > position)
+		job->track_cursor = position;
+	job->fetcher->job_add_items(job, num_tracks);
+	job->loaded = false;
+	job->changed = true;
+	job->last_progress = now_ms();
+	job->fetcher->playlist_browse_try(job);
+}
+
+// removed tracks take their slots with them, and maybe their album
+void SP_CALLCONV CoverFetcher::tracks_removed_cb(sp_playlist *pl, const int *tracks,
+	int num_tracks, void *userdata)
+{
+	struct job *job = (struct job*)userdata;
+	CoverFetcher *self = job->fetcher;
+	printf("[*] %d tracks removed from %s\n", num_tracks, sp_playlist_name(pl));
+	if (!job->watching)
+		return;
+
+	// back to front, so the indices further up stay put
+	std::vector<int> removed(tracks, tracks + num_tracks);
+	std::sort(removed.rbegin(), removed.rend());
+	for (size_t i = 0; i < removed.size(); ++i) {
+		int index = removed[i];
+		if (index < 0 || index >= (int)job->track_loaded.size())
+			continue;
+		if (job->track_loaded[index])
+			job->tracks_loaded--;
+		else
+			self->job_add_items(job, -1);
+		job->track_loaded.erase(job->track_loaded.begin() + index);
+		if (index < job->track_cursor)
+			job->track_cursor--;
+	}
+	job->changed = true;
+
+	// albums no track is left on. Their covers stay where they are
+	std::set<std::string> left;
+	int n = sp_playlist_num_tracks(pl);
+	for (int i = 0; i < n; ++i) {
+		sp_track *t = sp_playlist_track(pl, i);
+		if (t && sp_track_is_loaded(t))
+			left.insert(album_uri(sp_track_album(t)));
+	}
+	std::set<std::string>::iterator it = job->albums.begin();
+	while (it != job->albums.end()) {
+		if (left.count(*it)) {
+			++it;
+			continue;
+		}
+		if (self->config.shard_index == 0)
+			printf("[*] Job %d: %s is gone from the playlist\n", job->id, it->c_str());
+		snapshot_drop(job->snapshot, *it);
+		job->albums.erase(it++);
+	}
+
+	if (!job->loaded)
+		self->playlist_browse_try(job);
+}
+
+// moved tracks land in front of new_position, an index from before the move
+void SP_CALLCONV CoverFetcher::tracks_moved_cb(sp_playlist *pl, const int *tracks,
+	int num_tracks, int new_position, void *userdata)
+{
+	struct job *job = (struct job*)userdata;
+	if (!job->watching)
+		return;
+
+	std::vector<int> moved(tracks, tracks + num_tracks);
+	std::sort(moved.begin(), moved.end());
+	std::vector<bool> flags;
+	int before = 0;
+	for (size_t i = 0; i < moved.size(); ++i) {
+		if (moved[i] < 0 || moved[i] >= (int)job->track_loaded.size())
+			return;
+		flags.push_back(job->track_loaded[moved[i]]);
+		if (moved[i] < new_position)
+			before++;
+	}
+	for (size_t i = moved.size(); i-- > 0; )
+		job->track_loaded.erase(job->track_loaded.begin() + moved[i]);
+	int at = new_position - before;
+	if (at > (int)job->track_loaded.size())
+		at = (int)job->track_loaded.size();
+	job->track_loaded.insert(job->track_loaded.begin() + at, flags.begin(), flags.end());
+
+	job->track_cursor = 0;
+	while (job->track_cursor < (int)job->track_loaded.size() &&
+		job->track_loaded[job->track_cursor])
+		job->track_cursor++;
+	job->changed = true;
+}
+
+// bind a job that is looking for its playlist by name
+bool CoverFetcher::job_match_name(struct job *job, sp_playlist *pl)
+{
+	if (job->playlist || job->name.empty())
+		return false;
+
+	// skip this playlist if it is not the playlist name of interest
+	if (strcasecmp(sp_playlist_name(pl), job->name.c_str()))
+		return false;
+
+	// printf("[*] Found playlist %s\n", job->name.c_str());
+	sp_playlist_add_ref(pl);
+	job->playlist = pl;
+	return true;
+}
+
+// see if any job is waiting for this playlist. The scan callbacks get
+// registered from jobs_service(), not in a callback
+void SP_CALLCONV CoverFetcher::skim_metadata_updated_cb(sp_playlist *pl, void *userdata)
+{
+	CoverFetcher *self = (CoverFetcher*)userdata;
+	for (size_t i = 0; i < self->jobs.size(); ++i)
+		self->job_match_name(self->jobs[i], pl);
+}
+
+void SP_CALLCONV CoverFetcher::container_loaded_cb(sp_playlistcontainer *pc, void *userdata)
+{
+	CoverFetcher *self = (CoverFetcher*)userdata;
+	int num_playlists = sp_playlistcontainer_num_playlists(pc);
+	printf("[*] %d root playlists loaded\n", num_playlists);
+	self->container_loaded = true;
+
+	if (num_playlists == 0) {
+		fprintf(stderr, "[!] No playlists in root container\n");
+		for (size_t i = 0; i < self->jobs.size(); ++i) {
+			struct job *job = self->jobs[i];
+			if (!job->playlist && !job->name.empty())
+				job->error = "no playlist named " + job->name;
+		}
+	}
+
+	// it would be neat if we could just read the playlist name here
+	// but I tried that and they were all blank (as of v12.1.51)
+	// so instead register the playlist_metadata_changed callback for
+	// all playlists (lame) and check the name there
+	for (int i = 0; i < num_playlists; ++i) {
+		sp_playlist *pl = sp_playlistcontainer_playlist(pc, i);
+		// TODO remove the callbacks somewhere
+		sp_error err = sp_playlist_add_callbacks(pl, &self->pl_skim_callbacks, self);
+		if (err != SP_ERROR_OK) {
+			fprintf(stderr, "[!] %s\n", sp_error_message(err));
+			metrics_error(err);
+		}
+	}
+}
+
+bool playlist_uri_parse(const std::string &in, std::string &out)
+{
+	static const char *hosts[] = { "open.spotify.com/user/", "play.spotify.com/user/" };
+
+	size_t p = in.find("uri=");
+	if (p != std::string::npos)
+		return playlist_uri_parse(in.substr(p + 4), out);
+
+	if (in.compare(0, 8, "spotify:") == 0) {
+		out = in.substr(0, in.find_first_of("&?# "));
+		return true;
+	}
+
+	for (size_t h = 0; h < sizeof(hosts) / sizeof(hosts[0]); ++h) {
+		p = in.find(hosts[h]);
+		if (p == std::string::npos)
+			continue;
+		std::string rest = in.substr(p + strlen(hosts[h]));
+		size_t sep = rest.find("/playlist/");
+		if (sep == std::string::npos || sep == 0)
+			return false;
+		std::string id = rest.substr(sep + 10);
+		id = id.substr(0, id.find_first_of("/?#"));
+		if (id.empty())
+			return false;
+		out = "spotify:user:" + rest.substr(0, sep) + ":playlist:" + id;
+		return true;
+	}
+	return false;
+}
+
+// open the playlist straight from its link, the root container is never loaded
+bool CoverFetcher::playlist_open_uri(struct job *job)
+{
+	sp_link *link = sp_link_create_from_string(job->uri.c_str());
+	if (!link || sp_link_type(link) != SP_LINKTYPE_PLAYLIST) {
+		if (link)
+			sp_link_release(link);
+		job->error = "not a playlist: " + job->uri;
+		return false;
+	}
+
+	// sp_playlist_create hands us a reference, released when the job ends
+	job->playlist = sp_playlist_create(session, link);
+	sp_link_release(link);
+	if (!job->playlist) {
+		job->error = "unable to open playlist " + job->uri;
+		return false;
+	}
+	return true;
+}
+
+void SP_CALLCONV CoverFetcher::logged_in_cb(sp_session *sess, sp_error error)
+{
+	CoverFetcher *self = (CoverFetcher*)sp_session_userdata(sess);
+
+	if (SP_ERROR_OK != error) {
+		fprintf(stderr, "[!] Login failed: %s\n", sp_error_message(error));
+		metrics_error(error);
+		self->login_failed = true;
+		return;
+	}
+
+	printf("[*] Login successful\n");
+	self->logged_in = true;
+}
+
+void SP_CALLCONV CoverFetcher::connection_error_cb(sp_session *sess, sp_error error)
+{
+	fprintf(stderr, "[!] Spotify Connection Error: %s\n",
+		sp_error_message(error));
+	metrics_error(error);
+}
+
+void SP_CALLCONV CoverFetcher::log_message_cb(sp_session *sess, const char *data)
+{
+	CoverFetcher *self = (CoverFetcher*)sp_session_userdata(sess);
+	if (self->config.verbose)
+		fprintf(stderr, "[~] %s", data);
+}
+
+void SP_CALLCONV CoverFetcher::notify_main_thread_cb(sp_session *sess)
+{
+	CoverFetcher *self = (CoverFetcher*)sp_session_userdata(sess);
+	self->notify();
+}
+
+void CoverFetcher::submit(const std::string &source, const std::string &outdir,
+	job_callback done, album_callback album)
+{
+	struct job *job = new struct job;
+	job->fetcher = this;
+	job->id = 0;
+	job->source = source;
+	job->outdir = outdir;
+	job->done = done;
+	job->on_album = album;
+	job->playlist = NULL;
+	job->scanning = false;
+	job->loaded = false;
+	job->snapshot = NULL;
+	job->watching = false;
+	job->reported = false;
+	job->changed = false;
+	job->tracks_loaded = 0;
+	job->track_cursor = 0;
+	job->last_progress = 0;
+	job->todo = 0;
+	job->covers = 0;
+	job->unavailable = 0;
+	job->duplicates = 0;
+	job->failed = 0;
+
+	if (journal_has_job(config.journal, outdir, source)) {
+		printf("[*] Skipping %s, finished in an earlier run\n", source.c_str());
+		if (done)
+			done(make_result(job, JOB_SKIPPED));
+		delete job;
+		return;
+	}
+
+	if (!playlist_uri_parse(source, job->uri))
+		job->name = source;
+
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		if (!pending_closed) {
+			// the placeholder item keeps the job alive until its playlist shows up
+			job_add_items(job, 1);
+			pending_jobs.push_back(job);
+			job = NULL;
+		}
+	}
+
+	if (job) {
+		if (done)
+			done(make_result(job, JOB_INTERRUPTED));
+		delete job;
+		return;
+	}
+	notify();
+}
+
+std::future<job_result> CoverFetcher::submit(const std::string &source,
+	const std::string &outdir)
+{
+	std::shared_ptr<std::promise<job_result> > promise(new std::promise<job_result>);
+	std::future<job_result> result = promise->get_future();
+	submit(source, outdir, [promise](const job_result &r) { promise->set_value(r); });
+	return result;
+}
+
+// pick up submitted jobs once we're logged in, at most max_jobs at a time
+void CoverFetcher::jobs_start()
+{
+	std::vector<struct job*> pending;
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		size_t n = 0;
+		if (jobs.size() < config.max_jobs)
+			n = config.max_jobs - jobs.size();
+		if (n > pending_jobs.size())
+			n = pending_jobs.size();
+		pending.assign(pending_jobs.begin(), pending_jobs.begin() + n);
+		pending_jobs.erase(pending_jobs.begin(), pending_jobs.begin() + n);
+	}
+
+	for (size_t i = 0; i < pending.size(); ++i) {
+		struct job *job = pending[i];
+		job->id = next_job_id++;
+		jobs.push_back(job);
+		job->last_progress = now_ms();
+
+		printf("[*] Job %d: %s -> %s\n", job->id,
+			job->uri.empty() ? job->name.c_str() : job->uri.c_str(),
+			job->outdir.c_str());
+
+		if (!config.prewarm && !outdirs_ready.count(job->outdir)) {
+			if (!create_dir(job->outdir.c_str()) ||
+				!layout_create(job->outdir, config.layout)) {
+				job->error = "unable to create " + job->outdir;
+				continue;
+			}
+			outdirs_ready.insert(job->outdir);
+		}
+
+		if (config.snapshot_dir && !config.prewarm) {
+			if (!create_dir(config.snapshot_dir)) {
+				job->error = std::string("unable to create ") + config.snapshot_dir;
+				continue;
+			}
+			job->snapshot = snapshot_open(config.snapshot_dir, job->outdir, job->source);
+			if (snapshot_previous(job->snapshot))
+				printf("[*] Job %d: %u albums in the last snapshot, fetching the rest\n",
+					job->id, (unsigned int)snapshot_previous(job->snapshot));
+		}
+
+		if (!job->uri.empty()) {
+			playlist_open_uri(job);
+			continue;
+		}
+
+		// by name: needs the root container. Once it has loaded the names
+		// can be read directly, before that the skim callbacks find it
+		if (!container) {
+			container = sp_session_playlistcontainer(session);
+			// TODO remove this callback somewhere
+			sp_playlistcontainer_add_callbacks(container, &pc_callbacks, this);
+		} else if (container_loaded) {
+			int n = sp_playlistcontainer_num_playlists(container);
+			bool all_loaded = true;
+			for (int j = 0; j < n && !job->playlist; ++j) {
+				sp_playlist *pl = sp_playlistcontainer_playlist(container, j);
+				if (sp_playlist_is_loaded(pl))
+					job_match_name(job, pl);
+				else
+					all_loaded = false;
+			}
+			if (!job->playlist && all_loaded)
+				job->error = "no playlist named " + job->name;
+		}
+	}
+}
+
+// register scan callbacks for found playlists, retire finished jobs
+void CoverFetcher::jobs_service()
+{
+	for (size_t i = 0; i < jobs.size(); ) {
+		struct job *job = jobs[i];
+
+		// a playlist that stops loading counts against the request timeout
+		// too, so a job always ends
+		if (!job->loaded && job->error.empty() &&
+			now_ms() - job->last_progress > config.request_timeout * 1000) {
+			if (!job->playlist) {
+				job->error = "playlist not found: " + job->source;
+			} else if (job->track_loaded.empty()) {
+				job->error = "playlist did not load: " + job->source;
+			} else {
+				// the lookahead only peeks so far, tracks past it may have
+				// loaded without ever being checked
+				int tracks = (int)job->track_loaded.size();
+				for (int t = job->track_cursor; t < tracks; ++t)
+					track_ready(job, t);
+
+				int left = tracks - job->tracks_loaded;
+				if (left == 0) {
+					if (!job->watching)
+						printf("[*] Playlist loaded: %s\n", sp_playlist_name(job->playlist));
+					job->watching = config.watch;
+				} else {
+					std::stringstream ss;
+					ss << job->source << ": " << left << " tracks never loaded";
+					failure_list.push_back(ss.str());
+					fprintf(stderr, "[!] Giving up on %s\n", ss.str().c_str());
+					job->failed += left;
+					job_add_items(job, -left);
+
+					// a watched playlist forgets them, they aren't counted any more
+					if (job->watching) {
+						job->track_loaded.assign(job->track_loaded.size(), true);
+						job->tracks_loaded = (int)job->track_loaded.size();
+						job->track_cursor = job->tracks_loaded;
+					}
+
+					// their albums would look removed, keep the last snapshot
+					snapshot_close(job->snapshot);
+					job->snapshot = NULL;
+				}
+				job->loaded = true;
+			}
+		}
+
+		if (!job->error.empty() && job->todo > 0)
+			job_add_items(job, -job->todo);
+
+		// if the playlist of interest has been found, scan the tracks.
+		// important not to do the callback registration changes here in main,
+		// not in a callback
+		if (job->playlist && !job->scanning && job->error.empty()) {
+			if (config.shard_index == 0)
+				catalog_playlist(config.catalog, job->source.c_str());
+			sp_playlist_add_callbacks(job->playlist, &pl_scan_callbacks, job);
+			job->scanning = true;
+
+			// it may already be loaded, e.g. from the cache
+			scan_metadata_updated_cb(job->playlist, job);
+		}
+
+		if (job->todo > 0 || (job->reported && !job->changed)) {
+			++i;
+			continue;
+		}
+
+		// the job isn't done until its covers are
+		writer_commit(out);
+
+		if (job->reported) {
+			job_update(job);
+			++i;
+			continue;
+		}
+
+		job_status status;
+		if (job->error.empty()) {
+			// a pre-warm run wrote no covers, the real run still has to
+			if (!config.prewarm)
+				journal_job_done(config.journal, job->outdir, job->source);
+			printf("[*] Job %d done: %u covers, %u duplicates, %u unavailable, %u failed\n",
+				job->id, job->covers.load(), job->duplicates.load(),
+				job->unavailable.load(), job->failed.load());
+			status = JOB_DONE;
+
+			std::vector<std::string> removed;
+			if (snapshot_save(job->snapshot, removed)) {
+				for (size_t r = 0; r < removed.size(); ++r)
+					printf("[*] Job %d: %s is gone from the playlist\n", job->id,
+						removed[r].c_str());
+				if (!removed.empty())
+					printf("[*] Job %d: %u albums removed since the last snapshot\n",
+						job->id, (unsigned int)removed.size());
+			}
+		} else {
+			fprintf(stderr, "[!] Job %d failed: %s\n", job->id, job->error.c_str());
+			status = JOB_FAILED;
+		}
+		if (job->done)
+			job->done(make_result(job, status));
+		export_flush(config.exporter);
+
+		// watch mode keeps it, holding one item so run() keeps going too
+		if (status == JOB_DONE && job->watching) {
+			printf("[*] Job %d: watching %s for changes\n", job->id, job->source.c_str());
+			job->reported = true;
+			job->changed = false;
+			job->done = job_callback();
+			todo_items++;
+			++i;
+			continue;
+		}
+
+		if (job->playlist) {
+			if (job->scanning)
+				sp_playlist_remove_callbacks(job->playlist, &pl_scan_callbacks, job);
+			sp_playlist_release(job->playlist);
+		}
+		snapshot_close(job->snapshot);
+		jobs.erase(jobs.begin() + i);
+		delete job;
+	}
+}
+
+// record the playlist's tracks in the catalog again, positions and all
+void CoverFetcher::playlist_catalog(struct job *job)
+{
+	if (!config.catalog || config.shard_index != 0)
+		return;
+	catalog_playlist(config.catalog, job->source.c_str());
+	int n = sp_playlist_num_tracks(job->playlist);
+	for (int i = 0; i < n; ++i) {
+		sp_track *t = sp_playlist_track(job->playlist, i);
+		if (!t || !sp_track_is_loaded(t))
+			continue;
+		sp_artist *artist = sp_track_num_artists(t) > 0 ? sp_track_artist(t, 0) : NULL;
+		catalog_track(config.catalog, job->source.c_str(), i + 1, sp_track_name(t),
+			artist ? sp_artist_name(artist) : "", album_uri(sp_track_album(t)).c_str());
+	}
+}
+
+// a watched playlist changed, and everything that came of it is done
+void CoverFetcher::job_update(struct job *job)
+{
+	job->changed = false;
+	printf("[*] Job %d updated: %u covers, %u duplicates, %u unavailable, %u failed\n",
+		job->id, job->covers.load(), job->duplicates.load(),
+		job->unavailable.load(), job->failed.load());
+
+	// gone albums were reported as they went
+	std::vector<std::string> removed;
+	snapshot_save(job->snapshot, removed);
+	playlist_catalog(job);
+	export_flush(config.exporter);
+}
+
+// after an interrupted run: note what was left and tell everyone waiting
+// on a job. Jobs submitted from here on are turned away.
+void CoverFetcher::jobs_abandon()
+{
+	std::map<album_key, struct request*>::iterator it;
+	for (it = albums_pending.begin(); it != albums_pending.end(); ++it)
+		journal_album_pending(config.journal, it->first.second, it->first.first);
+	if (!albums_pending.empty())
+		printf("[*] %u albums left pending\n", (unsigned int)albums_pending.size());
+
+	std::vector<struct job*> queued;
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		queued.swap(pending_jobs);
+		pending_closed = true;
+	}
+
+	// running jobs stay around, their requests may still point at them
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (jobs[i]->done)
+			jobs[i]->done(make_result(jobs[i], JOB_INTERRUPTED));
+		jobs[i]->done = job_callback();
+	}
+	for (size_t i = 0; i < queued.size(); ++i) {
+		if (queued[i]->done)
+			queued[i]->done(make_result(queued[i], JOB_INTERRUPTED));
+		delete queued[i];
+	}
+}
+
+bool CoverFetcher::run(bool keep_alive)
+{
+	int next_timeout = 0;
+	bool draining = false;
+	std::chrono::steady_clock::time_point deadline;
+
+	// a login that never gets an answer either way ends the run too
+	std::chrono::steady_clock::time_point login_deadline =
+		std::chrono::steady_clock::now() + std::chrono::seconds(config.request_timeout);
+
+	track_worker_run = true;
+	std::thread track_worker(&CoverFetcher::track_work, this);
+
+	std::unique_lock<std::mutex> lock(notify_mutex);
+
+	while (!quit_now.load() && !login_failed && (keep_alive || todo_items)) {
+		// wake at least once a second to look at deadlines and retries
+		if (next_timeout > 1000)
+			next_timeout = 1000;
+		notify_cond.wait_for(lock, std::chrono::milliseconds(next_timeout),
+			[this] { return notify_do != 0; });
+
+		notify_do = 0;
+		notify_mutex.unlock();
+
+		do {
+			sp_session_process_events(session, &next_timeout);
+			g_metrics.process_events_total++;
+		} while (next_timeout == 0);
+
+		if (!logged_in && !login_failed &&
+			std::chrono::steady_clock::now() > login_deadline) {
+			fprintf(stderr, "[!] Login failed: no answer in %d seconds\n",
+				config.request_timeout);
+			login_failed = true;
+		}
+		if (logged_in && !quit.load())
+			jobs_start();
+		requests_service();
+		optimize_service();
+		jobs_service();
+
+		// a playlist that came out of the cache loaded was dispatched in
+		// jobs_service(), its albums shouldn't sit in the heap for a loop
+		track_feed();
+		writer_tick(out);
+
+		g_metrics.todo_items = todo_items.load();
+
+		// stop(): no new work, let what's in flight land, then leave
+		if (quit.load() && !draining) {
+			draining = true;
+			deadline = std::chrono::steady_clock::now() +
+				std::chrono::seconds(config.drain_seconds);
+			printf("[*] Interrupted, draining %d requests (Ctrl-C again to quit now)\n",
+				inflight.load());
+		}
+
+		notify_mutex.lock();
+
+		if (draining && (inflight.load() <= 0 ||
+			std::chrono::steady_clock::now() > deadline))
+			break;
+	}
+	lock.unlock();
+
+	// covers being optimized are already fetched, finish them
+	if (optimizer) {
+		optimizer_drain(optimizer);
+		optimize_service();
+	}
+	writer_commit(out);
+	if (quit.load())
+		jobs_abandon();
+
+	track_worker_run = false;
+	track_worker.join();
+
+	return !login_failed;
+}
+
+bool CoverFetcher::finish()
+{
+	bool ok = deriver_close(deriver);
+	deriver = NULL;
+	return ok;
+}
@@ -0,0 +1,305 @@
+#ifndef SPOTIFART_FETCHER_H
+#define SPOTIFART_FETCHER_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include "include/api.h"
+#else
+#include <libspotify/api.h>
+#endif
+
+// C++ headers
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// C++11 headers
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+
+#include "derive.h"
+#include "pool.h"
+#include "queue.h"
+#include "writer.h"
+
+struct job;
+struct request;
+struct journal;
+struct exporter;
+struct catalog;
+struct writer;
+struct optimizer;
+struct deriver;
+
+// what became of an album that went down the pipeline
+enum album_status
+{
+	ALBUM_WRITTEN,		// cover saved to filename
+	ALBUM_CACHED,		// pre-warm run, metadata is in the cache
+	ALBUM_UNAVAILABLE,	// libspotify says the album isn't available
+	ALBUM_FAILED		// gave up, see reason
+};
+
+struct album_result
+{
+	std::string source;	// the job's playlist
+	std::string outdir;
+	std::string uri;
+	std::string artist;	// empty if the album never browsed
+	std::string album;
+	std::string filename;
+	size_t bytes;
+	int attempts;
+	std::string reason;
+	album_status status;
+};
+
+enum job_status
+{
+	JOB_DONE,
+	JOB_SKIPPED,		// the journal says an earlier run finished it
+	JOB_FAILED,		// couldn't run at all, see error
+	JOB_INTERRUPTED		// stop() came first
+};
+
+struct job_result
+{
+	int id;
+	std::string source;
+	std::string outdir;
+	job_status status;
+	std::string error;
+	unsigned int covers;
+	unsigned int duplicates;
+	unsigned int unavailable;
+	unsigned int failed;
+};
+
+typedef std::function<void(const album_result &)> album_callback;
+typedef std::function<void(const job_result &)> job_callback;
+
+// how covers are spread over subdirectories of the output directory
+enum output_layout
+{
+	LAYOUT_FLAT,		// all in one directory
+	LAYOUT_ALPHA,		// a/ar/ by the artist's first two characters
+	LAYOUT_HASH		// 3/3f/ by a hash of the file name
+};
+
+// which queued album the track worker gets next
+enum dispatch_order
+{
+	ORDER_POSITION,		// lowest playlist position first, every playlist's top comes in first
+	ORDER_FANOUT,		// the album with the most tracks waiting on it, then by position
+	ORDER_FIFO		// in the order their tracks loaded
+};
+
+struct fetcher_config
+{
+	const uint8_t *appkey;
+	size_t appkey_size;
+	const char *cache_location;
+	const char *settings_location;
+	int cache_size;		// MB, 0 lets libspotify pick, -1 leaves it alone
+	size_t max_jobs;	// playlists in flight at once
+	int request_timeout;	// seconds
+	int max_attempts;	// per album
+	int drain_seconds;	// how long stop() waits for requests in flight
+	dispatch_order order;
+	output_layout layout;
+	durability sync_mode;
+	int sync_batch;		// covers per fsync batch with DURABLE_BATCH
+	int optimize_threads;	// lossless JPEG optimization on this many threads, 0: off
+	std::vector<derive_spec> derivatives;	// smaller copies made of every cover written
+	int derive_threads;	// 0: one per core
+	bool embed_metadata;	// XMP with the artist, album, link, year and image ID
+	const char *snapshot_dir;	// only fetch albums new since the last run, NULL: all
+	bool watch;		// after the first pass keep following the playlists' changes
+	bool prewarm;		// load metadata into the cache, write nothing
+	bool verbose;		// pass libspotify's log through
+	int shard_index;	// only fetch albums that hash to this shard,
+	int shard_count;	// out of shard_count (1: all of them)
+	struct journal *journal;	// optional, not owned
+	struct exporter *exporter;	// optional, not owned
+	struct catalog *catalog;	// optional, not owned
+
+	fetcher_config();
+};
+
+/**
+ * The album art pipeline: a libspotify session, the playlists being worked
+ * on and every album request in flight.
+ *
+ * libspotify allows one session per process, so there is one CoverFetcher
+ * per process too. Everything it owns is touched from the thread inside
+ * run(), which is where the callbacks are called, apart from submit() and
+ * stop(), which are safe from anywhere (stop() from a signal handler too).
+ */
+class CoverFetcher
+{
+public:
+	explicit CoverFetcher(const fetcher_config &config);
+	~CoverFetcher();
+
+	// create the session
+	bool open();
+
+	// log in with the credentials libspotify remembered for username (or
+	// for anybody if NULL), false if there are none
+	bool relogin(const char *username);
+	bool login(const char *username, const char *password, bool remember);
+
+	/**
+	 * Queue a playlist, by name in the root container or anything
+	 * playlist_uri_parse() understands. done is called once when the job
+	 * is over and album once per album it fetched, both from run(), except
+	 * when the job never gets queued (skipped or stopping), in which case
+	 * done is called right away on the calling thread.
+	 */
+	void submit(const std::string &source, const std::string &outdir,
+		job_callback done, album_callback album = album_callback());
+	std::future<job_result> submit(const std::string &source, const std::string &outdir);
+
+	/**
+	 * Run the session until every job is done, or with keep_alive until
+	 * stop(). Returns false if the login failed.
+	 */
+	bool run(bool keep_alive);
+
+	// once run() is back: make the derivatives still waiting, false if
+	// any couldn't be made
+	bool finish();
+
+	// first call drains, the second gives up on whatever is in flight
+	void stop();
+
+	bool stopped() const { return quit.load(); }
+	const std::vector<std::string> &failures() const { return failure_list; }
+
+private:
+	typedef std::pair<std::string, std::string> album_key;
+
+	CoverFetcher(const CoverFetcher &);
+	CoverFetcher &operator=(const CoverFetcher &);
+
+	// libspotify callbacks, the userdata (or the session's) leads back here
+	static void SP_CALLCONV logged_in_cb(sp_session *sess, sp_error error);
+	static void SP_CALLCONV connection_error_cb(sp_session *sess, sp_error error);
+	static void SP_CALLCONV log_message_cb(sp_session *sess, const char *data);
+	static void SP_CALLCONV notify_main_thread_cb(sp_session *sess);
+	static void SP_CALLCONV container_loaded_cb(sp_playlistcontainer *pc, void *userdata);
+	static void SP_CALLCONV skim_metadata_updated_cb(sp_playlist *pl, void *userdata);
+	static void SP_CALLCONV scan_state_changed_cb(sp_playlist *pl, void *userdata);
+	static void SP_CALLCONV scan_metadata_updated_cb(sp_playlist *pl, void *userdata);
+	static void SP_CALLCONV tracks_added_cb(sp_playlist *pl, sp_track *const *tracks,
+		int num_tracks, int position, void *userdata);
+	static void SP_CALLCONV tracks_removed_cb(sp_playlist *pl, const int *tracks,
+		int num_tracks, void *userdata);
+	static void SP_CALLCONV tracks_moved_cb(sp_playlist *pl, const int *tracks,
+		int num_tracks, int new_position, void *userdata);
+	static void SP_CALLCONV album_cb(sp_albumbrowse *result, void *userdata);
+	static void SP_CALLCONV image_cb(sp_image *image, void *userdata);
+
+	void notify();
+	void job_add_items(struct job *job, int n);
+	void job_item_done(struct job *job);
+	void album_done(struct request *req, album_status status,
+		const std::string &filename, size_t bytes);
+	void cover_write(struct request *req, const void *data, size_t len);
+	void optimize_service();
+	void request_fail(struct request *req, const std::string &reason, bool retry);
+	void requests_service();
+	void track_enqueue(struct request *req);
+	void track_feed();
+	int get_album_image(struct request *req, sp_album *album);
+	void track_work();
+	void dispatch_track(struct job *job, int index, sp_track *t);
+	bool track_ready(struct job *job, int i);
+	void playlist_browse_try(struct job *job);
+	void playlist_catalog(struct job *job);
+	void job_update(struct job *job);
+	bool job_match_name(struct job *job, sp_playlist *pl);
+	bool playlist_open_uri(struct job *job);
+	void jobs_start();
+	void jobs_service();
+	void jobs_abandon();
+
+	fetcher_config config;
+	struct writer *out;
+	struct optimizer *optimizer;	// NULL unless optimize_threads
+	struct deriver *deriver;	// NULL unless derivatives
+	sp_session *session;
+	sp_session_config spconfig;
+	sp_session_callbacks session_callbacks;
+	sp_playlistcontainer_callbacks pc_callbacks;
+	sp_playlist_callbacks pl_skim_callbacks;
+	sp_playlist_callbacks pl_scan_callbacks;
+
+	bool logged_in;
+	bool login_failed;
+	sp_playlistcontainer *container;
+	bool container_loaded;
+	std::atomic<bool> quit;
+	std::atomic<bool> quit_now;
+
+	std::mutex notify_mutex;
+	std::condition_variable notify_cond;
+	int notify_do;
+
+	// albums waiting for the track worker to issue their browse. They wait
+	// in track_heap (run() thread only), ordered by config.order, and only
+	// the best few at a time go into track_queue, so an album that turns
+	// up late but ranks high never waits behind a long line
+	bounded_queue<struct request*> track_queue;
+	std::vector<struct request*> track_heap;
+	bool track_heap_dirty;		// a fan-out changed, reorder before the next pop
+	uint64_t track_seq;
+	std::atomic<int> track_queued;	// in track_queue
+	std::atomic<int> track_waiting;	// in track_heap
+	std::atomic<bool> track_worker_run;
+
+	// jobs is only touched from run(), submitters go through pending_jobs,
+	// which stops taking jobs once the run has been abandoned
+	std::mutex pending_mutex;
+	std::vector<struct job*> pending_jobs;
+	bool pending_closed;
+	std::vector<struct job*> jobs;
+	int next_job_id;
+	std::set<std::string> outdirs_ready;	// layout directories created
+	std::atomic<unsigned int> todo_items;
+
+	// Albums already sent down the pipeline, keyed by (album URI, output
+	// directory), so an album shared by many tracks or playlists is only
+	// fetched once, with how it ended. One that failed in a way retrying
+	// might fix is forgotten again; unavailable and permanently broken ones
+	// are remembered, their later tracks counted without a request.
+	// albums_pending holds the ones not finished yet, which is what the
+	// journal records on an interrupted run, and leads a duplicate track to
+	// the request it waits on.
+	std::map<album_key, album_status> albums_seen;
+	std::map<album_key, struct request*> albums_pending;
+	std::atomic<int> inflight;
+
+	// every album request in the pipeline, and the ones that gave up for good
+	object_pool<struct request> request_pool;
+	string_pool names;
+	std::set<struct request*> requests;
+	std::vector<std::string> failure_list;
+};
+
+/**
+ * Turn any of the playlist link forms the web app accepts into a spotify: URI
+ *   spotify:user:umphreys:playlist:6hBEw1ggOPkRZy9pBjibsA
+ *   http://open.spotify.com/user/umphreys/playlist/6hBEw1ggOPkRZy9pBjibsA
+ *   https://play.spotify.com/user/umphreys/playlist/6hBEw1ggOPkRZy9pBjibsA
+ *   https://embed.spotify.com/?uri=spotify:user:umphreys:playlist:6hBEw1ggOPkRZy9pBjibsA
+ */
+bool playlist_uri_parse(const std::string &in, std::string &out);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SPOTIFART_JOB_H
+#define SPOTIFART_JOB_H
+
+#include <stdint.h>
+
+// C++ headers
+#include <set>
+#include <string>
+#include <vector>
+
+// C++11 headers
+#include <atomic>
+
+#include "fetcher.h"
+
+struct snapshot;
+
+/**
+ * One playlist worth of covers. Internal to the fetcher.
+ *
+ * Jobs are created on whatever thread submits them but everything past
+ * CoverFetcher::submit() happens on the fetcher's thread.
+ */
+struct job
+{
+	CoverFetcher *fetcher;
+	int id;
+	std::string source;	// as submitted, for reporting
+	std::string name;	// playlist name in the root container, or
+	std::string uri;	// spotify: URI of the playlist
+	std::string outdir;
+	job_callback done;
+	album_callback on_album;
+
+	struct sp_playlist *playlist;
+	bool scanning;		// scan callbacks registered
+	bool loaded;		// every track has been dispatched
+	std::string error;	// set when the job can't run at all
+	struct snapshot *snapshot;	// the last run's albums, NULL unless diffing
+
+	// watch mode: once the playlist has loaded in full, track_loaded follows
+	// every track added, removed or moved, and the job stays around after
+	// reporting done
+	bool watching;
+	bool reported;		// done was reported, only updates from here on
+	bool changed;		// tracks came or went since the last update
+	std::set<std::string> albums;	// every album the playlist has had a track of
+
+	// track readiness, track_cursor is the first track that hasn't been
+	// seen loaded yet, so a metadata update never rechecks loaded tracks
+	std::vector<bool> track_loaded;
+	int tracks_loaded;
+	int track_cursor;
+	int64_t last_progress;	// steady clock ms the playlist last moved forward
+
+	// items left before the job is done, one per track plus a placeholder
+	// until the playlist is found
+	std::atomic<int> todo;
+	std::atomic<unsigned int> covers;
+	std::atomic<unsigned int> unavailable;
+	std::atomic<unsigned int> duplicates;
+	std::atomic<unsigned int> failed;
+};
+
+#endif
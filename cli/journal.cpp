@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+
+// C++ headers
+#include <fstream>
+#include <set>
+#include <string>
+
+#include "journal.h"
+
+struct journal
+{
+	FILE *fp;
+	std::set<std::string> done_albums;
+	std::set<std::string> done_jobs;
+	unsigned int pending_seen;
+};
+
+static std::string key(const std::string &outdir, const std::string &what)
+{
+	return outdir + '\t' + what;
+}
+
+// read back an earlier journal, pending records are informational only
+static void load(struct journal *j, const char *path)
+{
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.size() < 3 || line[1] != '\t')
+			continue;
+		std::string rest = line.substr(2);
+		switch (line[0]) {
+		case 'A':
+			j->done_albums.insert(rest);
+			break;
+		case 'J':
+			j->done_jobs.insert(rest);
+			break;
+		case 'P':
+			j->pending_seen++;
+			break;
+		}
+	}
+	printf("[*] Resuming: %u covers and %u playlists already done, %u were pending\n",
+		(unsigned int)j->done_albums.size(), (unsigned int)j->done_jobs.size(),
+		j->pending_seen);
+}
+
+struct journal *journal_open(const char *path, bool resume)
+{
+	struct journal *j = new struct journal;
+	j->pending_seen = 0;
+
+	if (resume)
+		load(j, path);
+
+	// a fresh run starts a fresh journal
+	j->fp = fopen(path, resume ? "a" : "w");
+	if (!j->fp) {
+		fprintf(stderr, "[!] Unable to open journal %s\n", path);
+		delete j;
+		return NULL;
+	}
+	return j;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+	fclose(j->fp);
+	delete j;
+}
+
+static void record(struct journal *j, char type, const std::string &outdir,
+	const std::string &what)
+{
+	if (!j)
+		return;
+	fprintf(j->fp, "%c\t%s\t%s\n", type, outdir.c_str(), what.c_str());
+	fflush(j->fp);
+}
+
+void journal_album_done(struct journal *j, const std::string &outdir, const std::string &uri)
+{
+	record(j, 'A', outdir, uri);
+}
+
+void journal_album_pending(struct journal *j, const std::string &outdir, const std::string &uri)
+{
+	record(j, 'P', outdir, uri);
+}
+
+void journal_job_done(struct journal *j, const std::string &outdir, const std::string &source)
+{
+	record(j, 'J', outdir, source);
+}
+
+bool journal_has_album(struct journal *j, const std::string &outdir, const std::string &uri)
+{
+	return j && j->done_albums.count(key(outdir, uri)) > 0;
+}
+
+bool journal_has_job(struct journal *j, const std::string &outdir, const std::string &source)
+{
+	return j && j->done_jobs.count(key(outdir, source)) > 0;
+}
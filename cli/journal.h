@@ -0,0 +1,33 @@
+#ifndef SPOTIFART_JOURNAL_H
+#define SPOTIFART_JOURNAL_H
+
+#include <string>
+
+/**
+ * Checkpoint journal, so an interrupted run can pick up where it stopped.
+ *
+ * An append-only text file, one record per line, tab separated:
+ *
+ *   A <outdir> <album uri>   cover written
+ *   P <outdir> <album uri>   album was queued or in flight at shutdown
+ *   J <outdir> <source>      every track of the playlist was handled
+ *
+ * Each record is flushed as it is written, so a crash loses at most the
+ * line being written. Not thread safe, a journal belongs to the fetcher
+ * thread that owns it. Every call accepts a NULL journal and does nothing.
+ */
+struct journal;
+
+// NULL if the file can't be opened
+struct journal *journal_open(const char *path, bool resume);
+void journal_close(struct journal *j);
+
+void journal_album_done(struct journal *j, const std::string &outdir, const std::string &uri);
+void journal_album_pending(struct journal *j, const std::string &outdir, const std::string &uri);
+void journal_job_done(struct journal *j, const std::string &outdir, const std::string &source);
+
+// only answer true when resuming
+bool journal_has_album(struct journal *j, const std::string &outdir, const std::string &uri);
+bool journal_has_job(struct journal *j, const std::string &outdir, const std::string &source);
+
+#endif
@@ -0,0 +1,23 @@
+#ifdef SPOTIFART_JPEG
+
+#include "jpegerr.h"
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error *err = (struct jpeg_error*)cinfo->err;
+	longjmp(err->jump, 1);
+}
+
+static void jpeg_error_quiet(j_common_ptr cinfo, int level)
+{
+}
+
+struct jpeg_error_mgr *jpeg_error_init(struct jpeg_error *err)
+{
+	jpeg_std_error(&err->mgr);
+	err->mgr.error_exit = jpeg_error_exit;
+	err->mgr.emit_message = jpeg_error_quiet;
+	return &err->mgr;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SPOTIFART_JPEGERR_H
+#define SPOTIFART_JPEGERR_H
+
+#ifdef SPOTIFART_JPEG
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+/**
+ * libjpeg's default error_exit() calls exit() and its warnings go to
+ * stderr. This one says nothing and longjmp()s to jump instead, so set
+ * that up with setjmp() before the first libjpeg call that can fail.
+ */
+struct jpeg_error
+{
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+// what goes in cinfo->err
+struct jpeg_error_mgr *jpeg_error_init(struct jpeg_error *err);
+
+#endif
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#include "include/api.h"
+#define snprintf _snprintf
+#else
+#include <libspotify/api.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+// C++ headers
+#include <string>
+
+// C++11 headers
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "metrics.h"
+
+struct metrics g_metrics;
+
+static std::thread g_metrics_thread;
+static std::atomic<bool> g_metrics_run(false);
+static std::atomic<uint64_t> g_events_rate(0);
+static const char *g_metrics_path = NULL;
+static SOCKET g_metrics_sock = INVALID_SOCKET;
+static int g_metrics_interval = 5;
+static time_t g_metrics_start;
+
+void metrics_error(int code)
+{
+	if (code < 0 || code >= METRICS_MAX_ERROR)
+		code = METRICS_MAX_ERROR - 1;
+	g_metrics.errors[code]++;
+}
+
+void metrics_progress()
+{
+	g_metrics.last_progress = (int64_t)time(NULL);
+}
+
+static void put(std::string &out, const char *name, const char *type,
+	const char *help, long long value)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+		name, help, name, type, name, value);
+	out += line;
+}
+
+// Prometheus text exposition format, version 0.0.4
+static std::string render()
+{
+	std::string out;
+	put(out, "spotifart_queue_depth", "gauge",
+		"Albums waiting for a browse", g_metrics.queue_depth.load());
+	put(out, "spotifart_browses_inflight", "gauge",
+		"Album browse requests outstanding", g_metrics.browses_inflight.load());
+	put(out, "spotifart_images_inflight", "gauge",
+		"Cover image requests outstanding", g_metrics.images_inflight.load());
+	put(out, "spotifart_todo_items", "gauge",
+		"Items left before the run completes", g_metrics.todo_items.load());
+	put(out, "spotifart_browses_total", "counter",
+		"Album browse requests issued", g_metrics.browses_total.load());
+	put(out, "spotifart_images_total", "counter",
+		"Cover image requests issued", g_metrics.images_total.load());
+	put(out, "spotifart_images_invalid_total", "counter",
+		"Cover images rejected as not JPEG or structurally broken", g_metrics.images_invalid.load());
+	put(out, "spotifart_covers_written_total", "counter",
+		"Cover files written", g_metrics.covers_written.load());
+	put(out, "spotifart_bytes_written_total", "counter",
+		"Cover bytes written", g_metrics.bytes_written.load());
+	put(out, "spotifart_bytes_saved_total", "counter",
+		"Cover bytes saved by lossless JPEG optimization", g_metrics.bytes_saved.load());
+	put(out, "spotifart_process_events_total", "counter",
+		"Calls to sp_session_process_events", g_metrics.process_events_total.load());
+	put(out, "spotifart_process_events_rate", "gauge",
+		"Calls to sp_session_process_events in the last second", g_events_rate.load());
+	put(out, "spotifart_last_progress_seconds", "gauge",
+		"Unix time an item last finished", g_metrics.last_progress.load());
+	put(out, "spotifart_start_time_seconds", "gauge",
+		"Unix time the process started", (long long)g_metrics_start);
+
+	out += "# HELP spotifart_errors_total libspotify errors by sp_error code\n";
+	out += "# TYPE spotifart_errors_total counter\n";
+	for (int i = 0; i < METRICS_MAX_ERROR; ++i) {
+		uint64_t n = g_metrics.errors[i].load();
+		if (!n)
+			continue;
+		char line[256];
+		snprintf(line, sizeof(line),
+			"spotifart_errors_total{code=\"%d\",message=\"%s\"} %llu\n",
+			i, sp_error_message((sp_error)i), (unsigned long long)n);
+		out += line;
+	}
+	return out;
+}
+
+// write to a temp name first so a scraper never sees a half written file
+static void write_file()
+{
+	std::string tmp = std::string(g_metrics_path) + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp) {
+		fprintf(stderr, "[!] Unable to write metrics to %s\n", tmp.c_str());
+		return;
+	}
+	std::string body = render();
+	fwrite(body.data(), 1, body.size(), fp);
+	fclose(fp);
+#ifdef _WIN32
+	remove(g_metrics_path);
+#endif
+	rename(tmp.c_str(), g_metrics_path);
+}
+
+// one request per connection, whatever the path
+static void serve_one()
+{
+	SOCKET client = accept(g_metrics_sock, NULL, NULL);
+	if (client == INVALID_SOCKET)
+		return;
+
+	// a client that connects and says nothing must not hold up metrics_stop
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(client, &fds);
+	struct timeval tv = { 5, 0 };
+	if (select((int)client + 1, &fds, NULL, NULL, &tv) <= 0) {
+		closesocket(client);
+		return;
+	}
+
+	char req[1024];
+	recv(client, req, sizeof(req), 0);
+
+	std::string body = render();
+	char hdr[256];
+	snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %u\r\n"
+		"Connection: close\r\n\r\n", (unsigned int)body.size());
+	std::string resp = std::string(hdr) + body;
+
+	const char *p = resp.data();
+	size_t left = resp.size();
+	while (left > 0) {
+		int n = send(client, p, (int)left, 0);
+		if (n <= 0)
+			break;
+		p += n;
+		left -= n;
+	}
+	closesocket(client);
+}
+
+static void metrics_work()
+{
+	typedef std::chrono::steady_clock clock;
+	uint64_t last_events = g_metrics.process_events_total.load();
+	clock::time_point last_sample = clock::now();
+	clock::time_point last_write = last_sample;
+
+	while (g_metrics_run.load()) {
+		if (g_metrics_sock != INVALID_SOCKET) {
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(g_metrics_sock, &fds);
+			struct timeval tv = { 1, 0 };
+			if (select((int)g_metrics_sock + 1, &fds, NULL, NULL, &tv) > 0)
+				serve_one();
+		} else {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+
+		// a scrape wakes us early, so go by the clock rather than by loops
+		clock::time_point now = clock::now();
+		if (now - last_sample >= std::chrono::seconds(1)) {
+			uint64_t events = g_metrics.process_events_total.load();
+			g_events_rate = events - last_events;
+			last_events = events;
+			last_sample = now;
+		}
+
+		if (g_metrics_path &&
+			now - last_write >= std::chrono::seconds(g_metrics_interval)) {
+			write_file();
+			last_write = now;
+		}
+	}
+
+	if (g_metrics_path)
+		write_file();
+}
+
+static bool open_listener(int port)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return false;
+#endif
+	g_metrics_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (g_metrics_sock == INVALID_SOCKET)
+		return false;
+
+	int on = 1;
+	setsockopt(g_metrics_sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((unsigned short)port);
+
+	if (bind(g_metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(g_metrics_sock, 4) != 0) {
+		closesocket(g_metrics_sock);
+		g_metrics_sock = INVALID_SOCKET;
+		return false;
+	}
+	return true;
+}
+
+bool metrics_start(const char *path, int port, int interval)
+{
+	g_metrics_start = time(NULL);
+	g_metrics.last_progress = (int64_t)g_metrics_start;
+
+	if (!path && !port)
+		return true;
+
+	if (port && !open_listener(port)) {
+		fprintf(stderr, "[!] Unable to listen for metrics on port %d\n", port);
+		return false;
+	}
+	if (port)
+		printf("[*] Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+
+	g_metrics_path = path;
+	g_metrics_interval = interval > 0 ? interval : 1;
+	g_metrics_run = true;
+	g_metrics_thread = std::thread(metrics_work);
+	return true;
+}
+
+void metrics_stop()
+{
+	if (!g_metrics_run.load())
+		return;
+	g_metrics_run = false;
+	g_metrics_thread.join();
+	if (g_metrics_sock != INVALID_SOCKET) {
+		closesocket(g_metrics_sock);
+		g_metrics_sock = INVALID_SOCKET;
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef SPOTIFART_METRICS_H
+#define SPOTIFART_METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+
+// sp_error codes are small integers (currently < 42), anything above this
+// is folded into the last slot
+#define METRICS_MAX_ERROR 64
+
+/**
+ * Runtime counters and gauges. Everything is a plain atomic so the
+ * libspotify callbacks, the track worker and the exporter can all touch
+ * it without locking.
+ */
+struct metrics
+{
+	// gauges
+	std::atomic<int64_t> queue_depth;
+	std::atomic<int64_t> browses_inflight;
+	std::atomic<int64_t> images_inflight;
+	std::atomic<int64_t> todo_items;
+
+	// counters
+	std::atomic<uint64_t> browses_total;
+	std::atomic<uint64_t> images_total;
+	std::atomic<uint64_t> images_invalid;	// not a JPEG, or a broken one
+	std::atomic<uint64_t> covers_written;
+	std::atomic<uint64_t> bytes_written;
+	std::atomic<uint64_t> bytes_saved;	// by the JPEG optimizer
+	std::atomic<uint64_t> process_events_total;
+	std::atomic<uint64_t> errors[METRICS_MAX_ERROR];
+
+	// unix time of the last finished item, lets monitoring spot stalls
+	std::atomic<int64_t> last_progress;
+};
+
+extern struct metrics g_metrics;
+
+// record a libspotify error (an sp_error value)
+void metrics_error(int code);
+
+// mark that an item just finished
+void metrics_progress();
+
+/**
+ * Start the exporter thread. Either argument may be disabled (NULL path,
+ * zero port). The file is rewritten every interval seconds, the HTTP
+ * endpoint only listens on 127.0.0.1.
+ */
+bool metrics_start(const char *path, int port, int interval);
+void metrics_stop();
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// C++ headers
+#include <deque>
+#include <vector>
+
+// C++11 headers
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "jpegerr.h"
+#include "optimize.h"
+
+#ifdef SPOTIFART_JPEG
+
+// ICC profiles are chunked into APP2 markers tagged with this
+#define ICC_MARKER (JPEG_APP0 + 2)
+#define ICC_TAG "ICC_PROFILE"
+
+// Exif is one APP1 marker, XMP uses APP1 too but starts differently
+#define EXIF_MARKER (JPEG_APP0 + 1)
+#define EXIF_TAG "Exif\0"
+
+static bool marker_tagged(jpeg_saved_marker_ptr m, int marker, const char *tag, size_t len)
+{
+	return m->marker == marker && m->data_length >= len && !memcmp(m->data, tag, len);
+}
+
+bool jpeg_optimize(const void *data, size_t len, std::vector<unsigned char> &out)
+{
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jpeg_error err;
+	unsigned char *buf = NULL;
+	unsigned long size = 0;
+
+	// one thread, so both sides can share the error manager
+	src.err = dst.err = jpeg_error_init(&err);
+
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+	if (setjmp(err.jump)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(buf);
+		return false;
+	}
+
+	jpeg_mem_src(&src, (unsigned char*)data, (unsigned long)len);
+	jpeg_save_markers(&src, EXIF_MARKER, 0xffff);
+	jpeg_save_markers(&src, ICC_MARKER, 0xffff);
+	jpeg_read_header(&src, TRUE);
+	jvirt_barray_ptr *coefs = jpeg_read_coefficients(&src);
+
+	jpeg_mem_dest(&dst, &buf, &size);
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.optimize_coding = TRUE;
+	jpeg_write_coefficients(&dst, coefs);
+
+	// the colour profile and the Exif orientation change what you see,
+	// the rest can go
+	for (jpeg_saved_marker_ptr m = src.marker_list; m; m = m->next) {
+		if (marker_tagged(m, ICC_MARKER, ICC_TAG, sizeof(ICC_TAG)) ||
+			marker_tagged(m, EXIF_MARKER, EXIF_TAG, sizeof(EXIF_TAG)))
+			jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&src);
+
+	bool smaller = size < len;
+	if (smaller)
+		out.assign(buf, buf + size);
+
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	free(buf);
+	return smaller;
+}
+
+#else
+
+bool jpeg_optimize(const void *data, size_t len, std::vector<unsigned char> &out)
+{
+	return false;
+}
+
+#endif
+
+struct optimizer
+{
+	std::vector<std::thread> threads;
+	std::function<void()> wake;
+
+	std::mutex mutex;
+	std::condition_variable work_cond;	// todo grew, or closing
+	std::condition_variable idle_cond;	// busy dropped to zero
+	std::deque<optimized> todo;
+	std::vector<optimized> finished;
+	int busy;		// put and not finished yet
+	bool closing;
+};
+
+static void optimizer_work(struct optimizer *o)
+{
+	std::unique_lock<std::mutex> lock(o->mutex);
+	for (;;) {
+		o->work_cond.wait(lock, [o] { return o->closing || !o->todo.empty(); });
+		if (o->todo.empty())
+			return;
+
+		optimized item = std::move(o->todo.front());
+		o->todo.pop_front();
+		lock.unlock();
+
+		std::vector<unsigned char> smaller;
+		item.changed = !item.data.empty() &&
+			jpeg_optimize(&item.data[0], item.data.size(), smaller);
+		if (item.changed)
+			item.data.swap(smaller);
+
+		lock.lock();
+		o->finished.push_back(std::move(item));
+		if (--o->busy == 0)
+			o->idle_cond.notify_all();
+		lock.unlock();
+
+		if (o->wake)
+			o->wake();
+		lock.lock();
+	}
+}
+
+struct optimizer *optimizer_open(int threads, const std::function<void()> &wake)
+{
+	struct optimizer *o = new struct optimizer;
+	o->wake = wake;
+	o->busy = 0;
+	o->closing = false;
+	for (int i = 0; i < (threads > 0 ? threads : 1); ++i)
+		o->threads.push_back(std::thread(optimizer_work, o));
+	return o;
+}
+
+void optimizer_close(struct optimizer *o)
+{
+	if (!o)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(o->mutex);
+		o->closing = true;
+	}
+	o->work_cond.notify_all();
+	for (size_t i = 0; i < o->threads.size(); ++i)
+		o->threads[i].join();
+	delete o;
+}
+
+void optimizer_put(struct optimizer *o, void *tag, const void *data, size_t len)
+{
+	const unsigned char *p = static_cast<const unsigned char*>(data);
+	std::lock_guard<std::mutex> lock(o->mutex);
+	o->todo.push_back(optimized());
+	o->todo.back().tag = tag;
+	o->todo.back().data.assign(p, p + len);
+	o->todo.back().original = len;
+	o->todo.back().changed = false;
+	o->busy++;
+	o->work_cond.notify_one();
+}
+
+bool optimizer_get(struct optimizer *o, optimized &out)
+{
+	std::lock_guard<std::mutex> lock(o->mutex);
+	if (o->finished.empty())
+		return false;
+	out = std::move(o->finished.back());
+	o->finished.pop_back();
+	return true;
+}
+
+void optimizer_drain(struct optimizer *o)
+{
+	std::unique_lock<std::mutex> lock(o->mutex);
+	o->idle_cond.wait(lock, [o] { return o->busy == 0; });
+}
@@ -0,0 +1,51 @@
+#ifndef SPOTIFART_OPTIMIZE_H
+#define SPOTIFART_OPTIMIZE_H
+
+#include <stddef.h>
+
+// C++ headers
+#include <functional>
+#include <vector>
+
+/**
+ * Lossless JPEG squeeze: the DCT coefficients are copied as they are, only
+ * the Huffman tables are rebuilt for this image and every marker but the
+ * ICC profile and Exif is dropped. The pixels come out bit for bit the same.
+ *
+ * False if the image couldn't be parsed, or came out no smaller, in which
+ * case the original is the one to keep. Always false when built without
+ * libjpeg (SPOTIFART_JPEG).
+ */
+bool jpeg_optimize(const void *data, size_t len, std::vector<unsigned char> &out);
+
+// a cover back from the pool, data is the optimized image or the original
+struct optimized
+{
+	void *tag;
+	std::vector<unsigned char> data;
+	size_t original;	// bytes before
+	bool changed;
+};
+
+/**
+ * Worker threads running jpeg_optimize(), so the fetcher thread never
+ * waits on the CPU. optimizer_put() copies the image and hands it to a
+ * worker, optimizer_get() collects finished ones in no particular order.
+ * wake is called from the worker whenever one finishes.
+ *
+ * put, get and drain are for one thread, the fetcher's.
+ */
+struct optimizer;
+
+struct optimizer *optimizer_open(int threads, const std::function<void()> &wake);
+
+// finishes whatever was put, the results are dropped
+void optimizer_close(struct optimizer *o);
+
+void optimizer_put(struct optimizer *o, void *tag, const void *data, size_t len);
+bool optimizer_get(struct optimizer *o, optimized &out);
+
+// wait for every image put so far
+void optimizer_drain(struct optimizer *o);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef SPOTIFART_POOL_H
+#define SPOTIFART_POOL_H
+
+#include <stddef.h>
+
+// C++ headers
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Free list of T carved out of slabs of slab_size, so a long run recycles
+ * the same objects instead of going back to the heap for every album.
+ * Objects are default constructed once and handed out again as they come
+ * back, whatever they held is still there: reset what matters after get().
+ * Not thread safe.
+ */
+template <typename T>
+class object_pool
+{
+public:
+	explicit object_pool(size_t slab_size) : slab_size(slab_size)
+	{
+	}
+
+	~object_pool()
+	{
+		for (size_t i = 0; i < slabs.size(); ++i)
+			delete[] slabs[i];
+	}
+
+	T *get()
+	{
+		if (free_list.empty()) {
+			T *slab = new T[slab_size];
+			slabs.push_back(slab);
+			for (size_t i = slab_size; i > 0; --i)
+				free_list.push_back(&slab[i - 1]);
+		}
+		T *obj = free_list.back();
+		free_list.pop_back();
+		return obj;
+	}
+
+	void put(T *obj)
+	{
+		free_list.push_back(obj);
+	}
+
+	// objects ever allocated, and how many of them are handed out
+	size_t allocated() const { return slabs.size() * slab_size; }
+	size_t in_use() const { return allocated() - free_list.size(); }
+
+private:
+	object_pool(const object_pool &);
+	object_pool &operator=(const object_pool &);
+
+	size_t slab_size;
+	std::vector<T*> slabs;
+	std::vector<T*> free_list;
+};
+
+/**
+ * One copy of every distinct string in use. A pointer stays valid until
+ * each intern() of that string has been matched by a release(), so it can
+ * outlive whatever libspotify object the string came from. Releasing a
+ * pointer the pool didn't hand out, or NULL, does nothing. Not thread safe.
+ */
+class string_pool
+{
+public:
+	const char *intern(const char *s)
+	{
+		std::unordered_map<std::string, size_t>::iterator it =
+			strings.insert(std::make_pair(std::string(s ? s : ""), (size_t)0)).first;
+		it->second++;
+		return it->first.c_str();
+	}
+
+	void release(const char *s)
+	{
+		if (!s)
+			return;
+		std::unordered_map<std::string, size_t>::iterator it = strings.find(s);
+		if (it != strings.end() && it->first.c_str() == s && --it->second == 0)
+			strings.erase(it);
+	}
+
+	size_t size() const { return strings.size(); }
+
+private:
+	// node based, so an element never moves once inserted
+	std::unordered_map<std::string, size_t> strings;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef SPOTIFART_QUEUE_H
+#define SPOTIFART_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C++11 headers
+#include <atomic>
+
+/**
+ * Bounded lock-free FIFO between pipeline stages.
+ *
+ * A ring of cells, each with a sequence number that says whose turn it is:
+ * seq == pos means the cell is free for the producer claiming pos, seq ==
+ * pos + 1 means it holds the item for the consumer at pos. Producers and
+ * consumers claim positions with a compare-exchange on their own counter,
+ * so neither side ever blocks the other. Any number of producers and
+ * consumers may use it; T should be cheap to copy (a pointer).
+ */
+template <typename T>
+class bounded_queue
+{
+public:
+	// capacity is rounded up to a power of two
+	explicit bounded_queue(size_t capacity)
+	{
+		size_t n = 2;
+		while (n < capacity)
+			n <<= 1;
+		cells = new cell[n];
+		mask = n - 1;
+		for (size_t i = 0; i < n; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	~bounded_queue()
+	{
+		delete[] cells;
+	}
+
+	// false if the queue is full
+	bool push(const T &item)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+		for (;;) {
+			cell *c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c->data = item;
+					c->seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// false if the queue is empty
+	bool pop(T &item)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			cell *c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					item = c->data;
+					c->seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+
+private:
+	struct cell
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	bounded_queue(const bounded_queue &);
+	bounded_queue &operator=(const bounded_queue &);
+
+	// producers and consumers each hammer their own counter, keep them on
+	// separate cache lines
+	cell *cells;
+	size_t mask;
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64];
+	std::atomic<size_t> tail;
+	char pad2[64];
+};
+
+#endif
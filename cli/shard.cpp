@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// C++ headers
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "shard.h"
+
+#ifdef _WIN32
+
+int shard_run(const shard_options &opts, int argc, char **argv)
+{
+	fprintf(stderr, "[!] -P needs fork(), not supported on Windows\n");
+	return 1;
+}
+
+#else
+
+std::string get_password();
+
+// one playlist's status lines from every shard, summed
+struct merged
+{
+	std::string source;
+	bool ok;
+	std::string error;
+	unsigned long covers;
+	unsigned long duplicates;
+	unsigned long unavailable;
+	unsigned long failed;
+};
+
+// children handle SIGINT themselves, we just wait for them
+static void sig_ignore(int signo)
+{
+}
+
+static void merge_line(std::vector<merged> &out, std::map<std::string, size_t> &index,
+	const std::string &line)
+{
+	size_t tab = line.find('\t');
+	if (tab == std::string::npos)
+		return;
+	std::string source = line.substr(0, tab);
+	std::string status = line.substr(tab + 1);
+
+	if (!index.count(source)) {
+		merged m;
+		m.source = source;
+		m.ok = true;
+		m.covers = m.duplicates = m.unavailable = m.failed = 0;
+		index[source] = out.size();
+		out.push_back(m);
+	}
+	merged &m = out[index[source]];
+
+	unsigned long covers, duplicates, unavailable, failed;
+	if (sscanf(status.c_str(), "OK %lu covers %lu duplicates %lu unavailable %lu failed",
+		&covers, &duplicates, &unavailable, &failed) == 4) {
+		m.covers += covers;
+		m.duplicates += duplicates;
+		m.unavailable += unavailable;
+		m.failed += failed;
+	} else if (m.ok) {
+		// the first error is the one reported
+		m.ok = false;
+		m.error = status.compare(0, 4, "ERR ") == 0 ? status.substr(4) : status;
+	}
+}
+
+// the batch is read by every child, so stdin has to go to a file first
+static bool copy_stdin(const std::string &path)
+{
+	std::ofstream out(path.c_str());
+	std::string line;
+	while (std::getline(std::cin, line))
+		out << line << "\n";
+	out.close();
+	return !!out;
+}
+
+static bool is_csv(const std::string &path)
+{
+	return path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+}
+
+// append the shards' exports to the real one, with one CSV header at most
+static void merge_exports(const char *path, const std::vector<std::string> &parts)
+{
+	FILE *out = fopen(path, "ab");
+	if (!out) {
+		fprintf(stderr, "[!] Unable to open export file %s\n", path);
+		return;
+	}
+	fseek(out, 0, SEEK_END);
+	bool header = ftell(out) > 0;
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		std::ifstream in(parts[i].c_str(), std::ios::binary);
+		std::string line;
+		bool first = true;
+		while (std::getline(in, line)) {
+			if (first && is_csv(parts[i])) {
+				first = false;
+				if (header)
+					continue;
+				header = true;
+			}
+			first = false;
+			fwrite(line.data(), 1, line.size(), out);
+			fputc('\n', out);
+		}
+		remove(parts[i].c_str());
+	}
+	fclose(out);
+}
+
+int shard_run(const shard_options &opts, int argc, char **argv)
+{
+	// our lines go to the same terminal as the children's
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	char tmpdir[] = "/tmp/spotifart-XXXXXX";
+	if (!mkdtemp(tmpdir)) {
+		fprintf(stderr, "[!] Unable to create a temp directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	std::string batch;
+	if (opts.batch_path && !strcmp(opts.batch_path, "-")) {
+		batch = std::string(tmpdir) + "/batch";
+		if (!copy_stdin(batch)) {
+			fprintf(stderr, "[!] Unable to save the batch from stdin\n");
+			return 1;
+		}
+	}
+
+	// children log in from their own settings directory. Without
+	// remembered credentials there they would all prompt at once
+	std::string password;
+	if (opts.username)
+		password = get_password();
+
+	mkdir(opts.cache_location, 0777);
+	if (strcmp(opts.cache_location, opts.settings_location))
+		mkdir(opts.settings_location, 0777);
+	if (opts.snapshot_dir)
+		mkdir(opts.snapshot_dir, 0777);
+
+	signal(SIGINT, sig_ignore);
+
+	std::vector<pid_t> pids;
+	std::vector<std::string> results;
+	std::vector<std::string> exports;
+	for (int i = 0; i < opts.shards; ++i) {
+		std::stringstream ss;
+		ss << i << "/" << opts.shards;
+		std::string shard = ss.str();
+		ss.str("");
+		ss << "/shard" << i;
+		std::string suffix = ss.str();
+		ss.str("");
+		ss << ".shard" << i;
+		std::string ext = ss.str();
+
+		std::vector<std::string> extra;
+		extra.push_back("-K");
+		extra.push_back(shard);
+		// sessions can't share a cache. A shard's albums are the same on
+		// every run, so -W with the same -P still fills the one it reads
+		extra.push_back("-C");
+		extra.push_back(opts.cache_location + suffix);
+		extra.push_back("-S");
+		extra.push_back(opts.settings_location + suffix);
+		extra.push_back("-R");
+		extra.push_back(std::string(tmpdir) + "/results" + ext);
+		if (!batch.empty()) {
+			extra.push_back("-B");
+			extra.push_back(batch);
+		}
+		if (opts.journal_path) {
+			extra.push_back("-J");
+			extra.push_back(opts.journal_path + ext);
+		}
+		if (opts.snapshot_dir) {
+			extra.push_back("-N");
+			extra.push_back(opts.snapshot_dir + suffix);
+		}
+		if (opts.export_path) {
+			// the extension picks the format, keep it
+			std::string path = std::string(tmpdir) + "/export" + ext +
+				(is_csv(opts.export_path) ? ".csv" : ".jsonl");
+			extra.push_back("-e");
+			extra.push_back(path);
+			exports.push_back(path);
+		}
+		if (opts.metrics_path) {
+			extra.push_back("-m");
+			extra.push_back(opts.metrics_path + ext);
+		}
+		if (opts.metrics_port) {
+			ss.str("");
+			ss << opts.metrics_port + i;
+			extra.push_back("-M");
+			extra.push_back(ss.str());
+		}
+		results.push_back(std::string(tmpdir) + "/results" + ext);
+
+		// later options win, so the shard's settings go after the user's
+		std::vector<char *> args(argv, argv + argc);
+		for (size_t j = 0; j < extra.size(); ++j)
+			args.push_back(const_cast<char *>(extra[j].c_str()));
+		args.push_back(NULL);
+
+		// the password goes down a pipe, an environment variable would
+		// stay readable for as long as the child runs
+		int fds[2] = { -1, -1 };
+		if (opts.username && pipe(fds) != 0) {
+			fprintf(stderr, "[!] Unable to start shard %d: %s\n", i, strerror(errno));
+			break;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "[!] Unable to start shard %d: %s\n", i, strerror(errno));
+			if (opts.username) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			break;
+		}
+		if (pid == 0) {
+			if (opts.username) {
+				char fd[16];
+				snprintf(fd, sizeof(fd), "%d", fds[0]);
+				setenv("SPOTIFART_PASSWORD_FD", fd, 1);
+				close(fds[1]);
+			}
+			execvp(argv[0], &args[0]);
+			fprintf(stderr, "[!] Unable to run %s: %s\n", argv[0], strerror(errno));
+			_exit(127);
+		}
+		if (opts.username) {
+			// a pipe holds far more than a password, this never blocks
+			close(fds[0]);
+			if (write(fds[1], password.data(), password.size()) != (ssize_t)password.size())
+				fprintf(stderr, "[!] Unable to pass the password to shard %d\n", i);
+			close(fds[1]);
+		}
+		printf("[*] Shard %s: pid %d\n", shard.c_str(), (int)pid);
+		pids.push_back(pid);
+	}
+
+	int ret = (int)pids.size() == opts.shards ? 0 : 1;
+	bool interrupted = false;
+	for (size_t i = 0; i < pids.size(); ++i) {
+		int status;
+		while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR)
+			;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+			interrupted = true;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "[!] Shard %d/%d exited with status %d\n", (int)i,
+				opts.shards, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			ret = 1;
+		}
+	}
+
+	std::vector<merged> jobs;
+	std::map<std::string, size_t> index;
+	for (size_t i = 0; i < results.size(); ++i) {
+		std::ifstream in(results[i].c_str());
+		std::string line;
+		while (std::getline(in, line))
+			merge_line(jobs, index, line);
+		remove(results[i].c_str());
+	}
+	if (opts.export_path)
+		merge_exports(opts.export_path, exports);
+	if (!batch.empty())
+		remove(batch.c_str());
+	rmdir(tmpdir);
+
+	FILE *fp = NULL;
+	if (opts.results_path) {
+		fp = fopen(opts.results_path, "a");
+		if (!fp)
+			fprintf(stderr, "[!] Unable to open results file %s\n", opts.results_path);
+	}
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		const merged &m = jobs[i];
+		std::stringstream ss;
+		if (m.ok)
+			ss << "OK " << m.covers << " covers " << m.duplicates << " duplicates "
+				<< m.unavailable << " unavailable " << m.failed << " failed";
+		else
+			ss << "ERR " << m.error;
+		printf("[*] %s: %s\n", m.source.c_str(), ss.str().c_str());
+		if (fp)
+			fprintf(fp, "%s\t%s\n", m.source.c_str(), ss.str().c_str());
+	}
+	if (fp)
+		fclose(fp);
+
+	// any shard stopped short means the whole run wants --resume
+	return interrupted ? 2 : ret;
+}
+
+#endif
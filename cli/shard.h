@@ -0,0 +1,32 @@
+#ifndef SPOTIFART_SHARD_H
+#define SPOTIFART_SHARD_H
+
+/**
+ * Coordinator for -P: libspotify allows one session per process, so to use
+ * more than one we run the same command line in several child processes.
+ *
+ * Child i gets -K i/n and only fetches the albums that hash to shard i, so
+ * every playlist is split by album and all children write into the same
+ * output directories without overlapping. Each child has its own cache,
+ * settings and snapshot directory (<dir>/shard<i>), journal and metrics;
+ * their results are merged back into one line per playlist.
+ */
+struct shard_options
+{
+	int shards;
+	const char *username;		// prompt once here instead of in every child
+	const char *cache_location;
+	const char *settings_location;
+	const char *batch_path;		// "-" is read here and handed on as a file
+	const char *results_path;
+	const char *journal_path;
+	const char *snapshot_dir;	// each child keeps <dir>/shard<i>
+	const char *export_path;	// each child exports to a temp file, merged here
+	const char *metrics_path;
+	int metrics_port;
+};
+
+// returns the exit status for the whole run
+int shard_run(const shard_options &opts, int argc, char **argv);
+
+#endif
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// C++ headers
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "snapshot.h"
+
+struct snapshot_entry
+{
+	uint64_t hash;
+	std::string uri;
+};
+
+struct snapshot
+{
+	std::string path;
+	std::string label;	// outdir and source, for whoever opens the file
+	std::vector<snapshot_entry> previous;	// sorted
+	std::vector<snapshot_entry> current;	// sorted when saved
+	std::vector<snapshot_entry> dropped;
+};
+
+// 64 bit FNV-1a, a playlist's worth of album URIs won't collide
+static uint64_t fnv1a64(const std::string &s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < s.size(); ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static snapshot_entry make_entry(const std::string &uri)
+{
+	snapshot_entry e;
+	e.hash = fnv1a64(uri);
+	e.uri = uri;
+	return e;
+}
+
+// by hash, the URI only breaks ties
+static bool entry_less(const snapshot_entry &a, const snapshot_entry &b)
+{
+	if (a.hash != b.hash)
+		return a.hash < b.hash;
+	return a.uri < b.uri;
+}
+
+static bool entry_equal(const snapshot_entry &a, const snapshot_entry &b)
+{
+	return a.hash == b.hash && a.uri == b.uri;
+}
+
+static void sort_unique(std::vector<snapshot_entry> &v)
+{
+	std::sort(v.begin(), v.end(), entry_less);
+	v.erase(std::unique(v.begin(), v.end(), entry_equal), v.end());
+}
+
+struct snapshot *snapshot_open(const char *dir, const std::string &outdir,
+	const std::string &source)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct snapshot *s = new struct snapshot;
+	s->label = outdir + '\t' + source;
+
+	uint64_t h = fnv1a64(s->label);
+	std::string name(16, '0');
+	for (int i = 15; i >= 0; --i, h >>= 4)
+		name[i] = hex[h & 15];
+	s->path = std::string(dir) + "/" + name + ".snap";
+
+	std::ifstream in(s->path.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+		s->previous.push_back(make_entry(line));
+	}
+	// written sorted, but it's a text file
+	sort_unique(s->previous);
+	return s;
+}
+
+void snapshot_close(struct snapshot *s)
+{
+	delete s;
+}
+
+size_t snapshot_previous(const struct snapshot *s)
+{
+	return s ? s->previous.size() : 0;
+}
+
+bool snapshot_has(const struct snapshot *s, const std::string &uri)
+{
+	if (!s)
+		return false;
+	snapshot_entry e = make_entry(uri);
+	std::vector<snapshot_entry>::const_iterator it =
+		std::lower_bound(s->previous.begin(), s->previous.end(), e, entry_less);
+	return it != s->previous.end() && entry_equal(*it, e);
+}
+
+void snapshot_add(struct snapshot *s, const std::string &uri)
+{
+	if (s)
+		s->current.push_back(make_entry(uri));
+}
+
+void snapshot_drop(struct snapshot *s, const std::string &uri)
+{
+	if (s)
+		s->dropped.push_back(make_entry(uri));
+}
+
+bool snapshot_save(struct snapshot *s, std::vector<std::string> &removed)
+{
+	if (!s)
+		return false;
+
+	sort_unique(s->current);
+	sort_unique(s->dropped);
+	std::vector<snapshot_entry> keep;
+	std::set_difference(s->current.begin(), s->current.end(),
+		s->dropped.begin(), s->dropped.end(), std::back_inserter(keep), entry_less);
+
+	std::vector<snapshot_entry> gone;
+	std::set_difference(s->previous.begin(), s->previous.end(),
+		keep.begin(), keep.end(), std::back_inserter(gone), entry_less);
+	for (size_t i = 0; i < gone.size(); ++i)
+		removed.push_back(gone[i].uri);
+
+	// never leave half a snapshot behind, that would refetch the rest
+	std::string tmp = s->path + ".part";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) {
+		fprintf(stderr, "[!] Unable to write snapshot %s: %s\n", tmp.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp, "# %s\n", s->label.c_str());
+	for (size_t i = 0; i < keep.size(); ++i)
+		fprintf(fp, "%s\n", keep[i].uri.c_str());
+	bool ok = fflush(fp) == 0 && !ferror(fp);
+	ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+	if (ok)
+		remove(s->path.c_str());
+#endif
+	if (!ok || rename(tmp.c_str(), s->path.c_str()) != 0) {
+		fprintf(stderr, "[!] Unable to write snapshot %s: %s\n", s->path.c_str(), strerror(errno));
+		remove(tmp.c_str());
+		return false;
+	}
+
+	// what was saved carries on, so a job that keeps going can save again
+	s->current = keep;
+	s->previous.swap(keep);
+	s->dropped.clear();
+	return true;
+}
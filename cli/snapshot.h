@@ -0,0 +1,50 @@
+#ifndef SPOTIFART_SNAPSHOT_H
+#define SPOTIFART_SNAPSHOT_H
+
+// C++ headers
+#include <string>
+#include <vector>
+
+/**
+ * The set of albums a playlist had the last time it ran, so the next run
+ * only fetches the ones added since and can tell which ones went away.
+ *
+ * One text file per playlist and output directory in the snapshot
+ * directory, named by a hash of the two: a comment line saying which, then
+ * one album URI per line, in the order of their 64 bit FNV-1a hashes. Both
+ * sets are kept as vectors sorted by hash, so a lookup is a binary search
+ * on integers and the diff is one merge. The file is only replaced when
+ * the run gets through the whole playlist.
+ *
+ * Not thread safe, a snapshot belongs to its job on the fetcher thread.
+ * Every call accepts a NULL snapshot and does nothing.
+ */
+struct snapshot;
+
+// loads what the last run saved, if anything
+struct snapshot *snapshot_open(const char *dir, const std::string &outdir,
+	const std::string &source);
+
+// frees it, without saving
+void snapshot_close(struct snapshot *s);
+
+// how many albums the last run saved
+size_t snapshot_previous(const struct snapshot *s);
+
+// was the album there last time
+bool snapshot_has(const struct snapshot *s, const std::string &uri);
+
+// the album is in the playlist and has its cover
+void snapshot_add(struct snapshot *s, const std::string &uri);
+
+// the album didn't get a cover this time, leave it for the next run
+void snapshot_drop(struct snapshot *s, const std::string &uri);
+
+/**
+ * Replace the file with this run's albums. removed gets the ones the last
+ * save had that this one doesn't, in hash order. The saved albums stay
+ * added, so a watched playlist can add and drop more and save again.
+ */
+bool snapshot_save(struct snapshot *s, std::vector<std::string> &removed);
+
+#endif
@@ -1,35 +1,32 @@
-#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/stat.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <Windows.h>
 #include <conio.h>
-#define strcasecmp _stricmp
-//#pragma comment(lib, "lib/win32/libspotify.lib")
-#include "include/api.h"
 #else
-#include <libspotify/api.h>
+#include <unistd.h>
 #endif
 
 // C++ headers
 #include <iostream>
-#include <ios>
-#include <sstream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 
-// C++11 headers
-#include <condition_variable>
-#include <mutex>
-#include <thread>
-#include <atomic>
-
+#include "catalog.h"
+#include "daemon.h"
+#include "derive.h"
+#include "export.h"
+#include "fetcher.h"
+#include "journal.h"
+#include "metrics.h"
+#include "shard.h"
 
 // forward declare getopt (included in project as a c file)
 extern "C" int getopt(int nargc, char * const nargv[], const char *ostr);
@@ -38,373 +35,153 @@ extern "C" char *optarg;
 extern "C" const uint8_t g_appkey[];
 extern "C" const size_t g_appkey_size;
 
-static std::mutex g_notify_mutex;
-static std::condition_variable g_notify_cond;
-
-// Track vector handling
-static std::mutex g_tracklist_mutex;
-static std::vector<sp_track*> g_track_vector;
-static std::atomic<unsigned int> g_tracks_processing(0);
-static std::atomic<bool> g_track_worker_run(true);
-
-static int g_notify_do;
-static bool g_verbose = false;
-static std::atomic<bool> g_browse_success(false);
-static sp_session *g_session = NULL;
-static const char *g_strlistname = NULL;
-static sp_playlist *g_playlist = NULL;
-static sp_track *g_currenttrack = NULL;
-static std::atomic<unsigned int> g_todo_items(1);
-
-static sp_playlistcontainer_callbacks pc_callbacks = {};
-static sp_playlist_callbacks pl_skim_callbacks = {};
-static sp_playlist_callbacks pl_scan_callbacks = {};
-static sp_session_callbacks session_callbacks = {};
-static sp_session_config spconfig = {};
-
-struct userdata
-{
-	const char *artist;
-	const char *album;
-};
+static CoverFetcher *g_fetcher = NULL;
+static FILE *g_results = NULL;
+static unsigned int g_jobs_failed = 0;
+static unsigned int g_jobs_interrupted = 0;
 
+// first SIGINT drains, the second one gives up right away
 static void sig_handler(int signo)
 {
-	if (signo == SIGINT)
-		g_todo_items = 0;
-}
-
-// TODO file name handling needs to be done in unicode
-// TODO certain filenames don't get created in windows (colon in name)
-static void SP_CALLCONV image_cb(sp_image *image, void *userdata)
-{
-	struct userdata *cb_data = (struct userdata*)userdata;
-	const char *str_artist = cb_data->artist;
-	const char *str_album = cb_data->album;
-
-	size_t len;
-	const void * data = sp_image_data(image, &len);
-	sp_imageformat format = sp_image_format(image);
-	if (format != SP_IMAGE_FORMAT_JPEG)
-	{
-		fprintf(stderr, "[!] Unsupported image format for %s - %s: %d\n",
-			str_artist, str_album, format);
-	}
-
-	std::stringstream ss;
-	ss << "img/" << str_artist << " - " << str_album << ".jpg";
-	std::string filename = ss.str();
-	std::cout << "[+] Writing " << filename << " --- " << len << " bytes" << std::endl;
-	std::ofstream file;
-	file.open(filename, std::ios::binary);
-	file.write(static_cast<const char*>(data), len);
-
-	free(userdata);
-
-	g_todo_items--;
-}
-
-static int get_album_image(sp_album* album)
-{
-	const char *str_album = sp_album_name(album);
-	const char *str_artist = sp_artist_name(sp_album_artist(album));
-	
-	// can be SP_IMAGE_SMALL, _NORMAL, or _LARGE
-	const byte * image_id = sp_album_cover(album, SP_IMAGE_SIZE_NORMAL);
-
-	sp_image *image = sp_image_create(g_session, image_id);
-	if (image == NULL)
-	{
-		fprintf(stderr, "[!] Album cover not available for %s - %s\n",
-			str_artist, str_album);
-		return -1;
-	}
-	struct userdata *cb_data = (struct userdata *)malloc(sizeof(struct userdata));
-	if (!cb_data)
-	{
-		fprintf(stderr, "[!] Memory allocation error\n");
-		return -1;
-	}
-
-	cb_data->artist = str_artist;
-	cb_data->album = str_album;
-
-	sp_image_add_load_callback(image, image_cb, (void*)cb_data);
-	return 0;
-}
-
-// this will service on the main thread	
-static void SP_CALLCONV album_cb(sp_albumbrowse *result, void *userdata)
-{
-	sp_album *album = sp_albumbrowse_album(result);
-	if (!album) {
-		fprintf(stderr, "[!] WTF - null album pointer in the album browse callback\n");
-		sp_albumbrowse_release(result);
-		g_todo_items--;
+	if (signo != SIGINT)
 		return;
-	}
-	sp_artist *artist = sp_album_artist(album);
-	const char *str_album = sp_album_name(album);
-	const char *str_artist = sp_artist_name(artist);
-
-	// TODO I had retries here to wait for the album to become available
-	// but that was pointless... need to move this to another thread to allow
-	// main thread to work (I think)
-	if (!sp_album_is_available(album)) {
-		fprintf(stderr, "[!] Album not available: %s - %s\n",
-				str_artist, str_album);
-		g_todo_items--;
-		return;
-	}
-
-	// TODO offload to a background worker?
-	// seems unnecessary as the track worker will throttle the overall flow
-	get_album_image(album);
-	sp_albumbrowse_release(result);
+	if (g_fetcher)
+		g_fetcher->stop();
 }
 
-/**
- * Service the track vector on a background thread.
- *
- * The whole point of this worker thread is to stare down the track vector (lame)
- * and issue album browse requests periodically. Performance was awful when issuing
- * several hundred album browse requests, and they would start failing as well. So
- * throttling back like this seems to work well. I guess I could do it in the main thread
- * but I wrote it when I wasn't sure what was going on with main. It _is_ the callback
- * thread, apparently. The docs at developer.spotify.com had me thinking it was a
- * library thread.
- */
-static void track_work()
+// a job is over: answer the daemon client and note it in the results file
+static void job_finished(const job_result &r, int client)
 {
-	while (g_track_worker_run.load()) {
-		{
-			std::lock_guard<std::mutex> lock(g_tracklist_mutex);
-			if (g_tracks_processing.load() < 5 && g_track_vector.size() > 0) {
-				sp_track *track = g_track_vector.back();
-				g_track_vector.pop_back();
-				sp_album *album = sp_track_album(track);
-				sp_albumbrowse *albumbrowse = sp_albumbrowse_create(
-					g_session, album, &album_cb, NULL);
-				sp_albumbrowse_add_ref(albumbrowse);
-			}
-		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
-	}
-}
-
-static void playlist_browse_try()
-{
-	sp_playlist_add_ref(g_playlist);
-	sp_playlist *pl = g_playlist;
-	
-	// printf("[*] Browsing playlist %s\n", sp_playlist_name(pl));
-
-	if (!sp_playlist_is_loaded(pl)) {
-		fprintf(stderr, "[!] Playlist %s not loaded yet\n", sp_playlist_name(pl));
-		sp_playlist_release(pl);
+	std::stringstream ss;
+	switch (r.status) {
+	case JOB_DONE:
+		ss << "OK " << r.covers << " covers " << r.duplicates
+			<< " duplicates " << r.unavailable << " unavailable "
+			<< r.failed << " failed\n";
+		break;
+	case JOB_SKIPPED:
+		daemon_reply(client, "OK already done\n");
 		return;
+	case JOB_FAILED:
+		ss << "ERR " << r.error << "\n";
+		g_jobs_failed++;
+		break;
+	case JOB_INTERRUPTED:
+		ss << "ERR interrupted\n";
+		g_jobs_interrupted++;
+		break;
 	}
+	daemon_reply(client, ss.str());
 
-	int tracks = sp_playlist_num_tracks(pl);
-
-	for (int i = 0; i < tracks; ++i) {
-		sp_track *t = sp_playlist_track(pl, i);
-		if (!t || !sp_track_is_loaded(t)) {
-			// fprintf(stderr, "[!] Track %d is not loaded\n", i);
-			// fprintf(stderr, "[!] Playlist %s not loaded yet\n", sp_playlist_name(pl));
-			sp_playlist_release(pl);
-			return;
-		}
+	if (g_results) {
+		fprintf(g_results, "%s\t%s", r.source.c_str(), ss.str().c_str());
+		fflush(g_results);
 	}
-
-	g_browse_success = true;
-	printf("[*] Playlist loaded: %s\n", sp_playlist_name(pl));
-
-	for (int j = 0; j < tracks; j++)
-	{
-		sp_track *t = sp_playlist_track(pl, j);
-		
-		if (sp_track_get_availability(g_session, t) != 
-							SP_TRACK_AVAILABILITY_AVAILABLE) {
-			fprintf(stderr, "[!] Track %d: %s is not available\n",
-				j+1, sp_track_name(t));
-			g_todo_items--;
-		} else {
-			// add reference to track and add it the track vector
-			sp_track_add_ref(t);
-			std::lock_guard<std::mutex> lock(g_tracklist_mutex);
-			g_track_vector.push_back(t);
-#if 0
-			printf("[+] Track %d: %s - %s\n", j+1,
-				sp_artist_name(sp_track_artist(t, 0)),
-				sp_track_name(t));
-#endif
-			
-		}
-	}
-	sp_playlist_release(pl);
-}
-
-static void SP_CALLCONV tracks_added(sp_playlist *pl, sp_track *const *tracks, int num_tracks,
-	int position, void *userdata)
-{
-	if (g_strlistname && !strcasecmp(sp_playlist_name(pl), g_strlistname))
-		printf("[*] %d tracks added to %s\n", num_tracks, sp_playlist_name(pl));
 }
 
-static void SP_CALLCONV playlist_state_changed(sp_playlist *pl, void *userdata)
+// client is the daemon connection waiting for the result, -1 if none
+static void job_submit(const std::string &source, const std::string &outdir, int client)
 {
+	g_fetcher->submit(source, outdir,
+		[client](const job_result &r) { job_finished(r, client); });
 }
 
-static void SP_CALLCONV playlist_metadata_updated(sp_playlist *pl, void *userdata)
+static void usage(const char *progname)
 {
-	const char* playlist_name = sp_playlist_name(pl);
-
-	// argument check
-	if (!g_strlistname) {
-		return;
-	}
-
-	// skip this playlist if it is not the playlist name of interest
-	if (strcasecmp(playlist_name, g_strlistname)) {
-		return;
-	}
-
-	// don't try to browse the playlist again if we've already successfully
-	// browsed once... (this callback will keep firing after we've moved on to
-	// other things)
-	if (g_browse_success.load())
-		return;
-
-	// printf("[*] Found playlist %s\n", playlist_name);
-
-	g_todo_items = sp_playlist_num_tracks(pl);
-	g_playlist = pl;
-	playlist_browse_try();
+	fprintf(stderr, "Usage: %s [-u <username>] {-l <listname> | -U <uri> | -B <file> | -D <socket>}\n"
+		"\t[-v] [-P <n>] [-j <n>] [-R <file>] [-J <file> [--resume]] [-N <dir>] [-w] [-e <file>] [-i <db> [-Q <cover>]] [-T <secs>] [-A <n>] [-o <dir>] [-L <layout>] [-p <order>] [-F <sync>] [-O <n>] [-X <list> [-E]] [-I] [-r] [-S <dir>] [-C <dir>] [-Z <MB>] [-W] [-m <file>] [-M <port>]\n", progname);
+	fprintf(stderr, "  -u <user>  log in as user, not needed once credentials are remembered\n");
+	fprintf(stderr, "  -l <name>  playlist name in your root container\n");
+	fprintf(stderr, "  -U <uri>   playlist URI or open/play.spotify.com link, any user's\n");
+	fprintf(stderr, "  -D <path>  daemon: stay logged in and take jobs on a Unix socket\n");
+	fprintf(stderr, "  -B <file>  batch: one playlist name or URI per line, - for stdin\n");
+	fprintf(stderr, "  -P <n>     split the albums across n processes, each with its own session\n");
+	fprintf(stderr, "  -j <n>     run at most n playlists at once, default 4\n");
+	fprintf(stderr, "  -R <file>  append a status line per playlist to file\n");
+	fprintf(stderr, "  -J <file>  checkpoint journal of finished covers and playlists\n");
+	fprintf(stderr, "  --resume   (or -c) skip everything the journal says is done\n");
+	fprintf(stderr, "  -N <dir>   snapshot each playlist's albums, later runs only fetch the new ones\n");
+	fprintf(stderr, "  -w         watch: after the first pass fetch covers as tracks are added, until Ctrl-C\n");
+	fprintf(stderr, "  -e <file>  export a record per track and album, CSV if file ends in .csv, else JSON Lines\n");
+	fprintf(stderr, "  -i <db>    keep an SQLite catalog of playlists, tracks, albums and covers\n");
+	fprintf(stderr, "  -Q <cover> list the playlists in the catalog using a cover (file, album URI or image ID)\n");
+	fprintf(stderr, "  -T <secs>  request timeout, also how long a playlist may stall, default 30\n");
+	fprintf(stderr, "  -A <n>     attempts per album before giving up, default 4\n");
+	fprintf(stderr, "  -o <dir>   output directory, default img\n");
+	fprintf(stderr, "  -L <name>  output layout: flat (default), alpha (a/ar/) or hash (3/3f/)\n");
+	fprintf(stderr, "  -p <order> which album to fetch next: position (default), fanout (most tracks) or fifo\n");
+	fprintf(stderr, "  -F <sync>  fsync covers: none (default), batch[:n] (every n, default 64) or file\n");
+	fprintf(stderr, "  -O <n>     losslessly shrink JPEG covers on n threads before writing\n");
+	fprintf(stderr, "  -X <list>  derivatives of every cover, e.g. webp:300,avif:300,jpeg:64\n");
+	fprintf(stderr, "  -E         only bring the derivatives of the covers in -o up to date, no login\n");
+	fprintf(stderr, "  -I         embed artist, album, album link, year and image ID as XMP\n");
+	fprintf(stderr, "  -r         remember credentials so later runs log in without a password\n");
+	fprintf(stderr, "  -S <dir>   libspotify settings directory (remembered credentials)\n");
+	fprintf(stderr, "  -C <dir>   libspotify cache directory, default $SPOTIFART_CACHE or sp_tmp\n");
+	fprintf(stderr, "  -Z <MB>    cache size budget, 0 lets libspotify pick (10%% of free disk)\n");
+	fprintf(stderr, "  -W         pre-warm: load playlist and album metadata into the cache only\n");
+	fprintf(stderr, "  -m <file>  dump Prometheus metrics to file every few seconds\n");
+	fprintf(stderr, "  -M <port>  serve Prometheus metrics on 127.0.0.1:port\n");
 }
 
-static void SP_CALLCONV container_loaded(sp_playlistcontainer *pc, void *userdata)
+/**
+ * Submit one job per line of a batch file ("-" for stdin). Lines use the
+ * daemon request format: playlist name or URI, optionally a tab and the
+ * output directory. Blank lines and lines starting with # are skipped.
+ */
+static bool batch_submit(const char *path, const char *outdir)
 {
-	int num_playlists = sp_playlistcontainer_num_playlists(pc);
-	printf("[*] %d root playlists loaded\n", num_playlists);
-	
-	if (num_playlists == 0) {
-		fprintf(stderr, "[!] No playlists in root container\n");
-		exit(0);
-	}
-
-	// it would be neat if we could just read the playlist name here
-	// but I tried that and they were all blank (as of v12.1.51)
-	// so instead register the playlist_metadata_changed callback for
-	// all playlists (lame) and check the name there
-	for (int i = 0; i < num_playlists; ++i) {
-		sp_playlist *pl = sp_playlistcontainer_playlist(pc, i);
-		// TODO remove the callbacks somewhere
-		sp_error err = sp_playlist_add_callbacks(pl, &pl_skim_callbacks, NULL);
-		if (err != SP_ERROR_OK) {
-			fprintf(stderr, "[!] %s\n", sp_error_message(err));
+	std::ifstream file;
+	std::istream *in = &std::cin;
+	if (strcmp(path, "-")) {
+		file.open(path);
+		if (!file) {
+			fprintf(stderr, "[!] Unable to open batch file %s\n", path);
+			return false;
 		}
+		in = &file;
 	}
-}
-
-static void SP_CALLCONV logged_in(sp_session *sess, sp_error error)
-{
-	sp_playlistcontainer *pc = sp_session_playlistcontainer(sess);
 
-	if (SP_ERROR_OK != error) {
-		fprintf(stderr, "[!] Login failed: %s\n", sp_error_message(error));
-		exit(1);
+	std::string line;
+	unsigned int n = 0;
+	while (std::getline(*in, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos)
+			job_submit(line, outdir, -1);
+		else
+			job_submit(line.substr(0, tab), line.substr(tab + 1), -1);
+		n++;
 	}
-
-	printf("[*] Login successful\n");
-
-	// TODO remove this callback somewhere
-	sp_playlistcontainer_add_callbacks(pc, &pc_callbacks, NULL);
-}
-
-static void SP_CALLCONV logged_out(sp_session *session)
-{
-	//g_logged_out = 1;
-}
-
-static void SP_CALLCONV connection_error(sp_session *session, sp_error error)
-{
-	fprintf(stderr, "[!] Spotify Connection Error: %s\n",
-		sp_error_message(error));
-}
-
-static void SP_CALLCONV log_message(sp_session *session, const char *data)
-{
-	if (g_verbose)
-		fprintf(stderr, "[~] %s", data);
-}
-
-static void SP_CALLCONV notify_main_thread(sp_session *sess)
-{
-	std::unique_lock<std::mutex> lock(g_notify_mutex);
-	g_notify_do = 1;
-	g_notify_cond.notify_all();
-}
-
-static void init_callbacks()
-{
-	pc_callbacks.container_loaded = container_loaded;
-
-	pl_skim_callbacks.playlist_state_changed = playlist_state_changed;
-	pl_skim_callbacks.playlist_metadata_updated = playlist_metadata_updated;
-
-	pl_scan_callbacks.playlist_state_changed = playlist_state_changed;
-	pl_scan_callbacks.tracks_added = tracks_added;
-	pl_scan_callbacks.playlist_metadata_updated = playlist_metadata_updated;
-
-	session_callbacks.logged_in = logged_in;
-	session_callbacks.logged_out = logged_out;
-	session_callbacks.connection_error = connection_error;
-	session_callbacks.notify_main_thread = notify_main_thread;
-	session_callbacks.log_message = log_message;
-
-	spconfig.api_version = SPOTIFY_API_VERSION;
-	spconfig.cache_location = "sp_tmp";
-	spconfig.settings_location = "sp_tmp";
-	spconfig.application_key = g_appkey;
-	spconfig.application_key_size = g_appkey_size;
-	spconfig.user_agent = "spotifart";
-	spconfig.callbacks = &session_callbacks;
+	printf("[*] %u jobs queued from %s\n", n, path);
+	return true;
 }
 
-static void usage(const char *progname)
+#ifndef _WIN32
+// a -P child gets the password the coordinator asked for on a pipe, whose
+// read end is named by SPOTIFART_PASSWORD_FD. Read once, then forgotten
+static std::string handed_password()
 {
-	fprintf(stderr, "Usage: %s -u <username> -l <listname>\n", progname);
-}
+	const char *env = getenv("SPOTIFART_PASSWORD_FD");
+	if (!env)
+		return "";
+	int fd = atoi(env);
+	unsetenv("SPOTIFART_PASSWORD_FD");
 
-static bool predicate()
-{
-	return g_notify_do ? true : false;
+	std::string password;
+	char buf[256];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		password.append(buf, n);
+	close(fd);
+	return password;
 }
-
-static bool create_dir(const char *path)
-{
-	int ret = 0;
-	struct stat st = {};
-	stat(path, &st);
-	if (st.st_mode & S_IFDIR)
-		return true;
-
-#ifdef _WIN32
-	if (!CreateDirectoryA(path, NULL))
-		ret = -1;
-#else
-	ret = mkdir(path, 0777);
 #endif
 
-	if (-1 == ret) {
-		fprintf(stderr, "Error creating directory %s\n", path);
-		return false;
-	}
-
-	return true;
-}
-
 std::string get_password()
 {
 	std::string password;
@@ -433,26 +210,253 @@ std::string get_password()
 	return password;
 }
 
+/**
+ * Log in, without prompting whenever possible.
+ *
+ * If libspotify has remembered credentials for this user (or for anybody,
+ * when no user was given) we relogin with those and skip the password round
+ * trip. Otherwise fall back to the password prompt, optionally asking
+ * libspotify to remember the credentials for next time.
+ */
+static bool session_login(CoverFetcher &fetcher, const char *username,
+	const char *settings, bool remember, const std::string &password)
+{
+	if (fetcher.relogin(username))
+		return true;
+
+	if (!username) {
+		fprintf(stderr, "[!] No remembered credentials in %s, use -u\n", settings);
+		return false;
+	}
+
+	return fetcher.login(username,
+		(password.empty() ? get_password() : password).c_str(), remember);
+}
+
 int main(int argc, char **argv)
 {
-	sp_session *sp;
-	sp_error err;
-	int next_timeout = 0;
+	fetcher_config config;
 	const char *username = NULL;
+	const char *listname = NULL;
+	const char *uri = NULL;
+	const char *socket_path = NULL;
+	const char *outdir = "img";
+	const char *batch_path = NULL;
+	const char *results_path = NULL;
+	const char *journal_path = NULL;
+	const char *export_path = NULL;
+	const char *catalog_path = NULL;
+	const char *query = NULL;
+	bool resume = false;
+	bool remember = false;
+	const char *metrics_path = NULL;
+	int metrics_port = 0;
+	int shards = 1;
+	bool shard_child = false;
+	std::string password;
+	bool derive_only = false;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "u:l:v")) != EOF) {
+	config.appkey = g_appkey;
+	config.appkey_size = g_appkey_size;
+
+	// environment first so jobs started from anywhere share one cache,
+	// the command line still wins
+	if (getenv("SPOTIFART_CACHE"))
+		config.cache_location = getenv("SPOTIFART_CACHE");
+	if (getenv("SPOTIFART_SETTINGS"))
+		config.settings_location = getenv("SPOTIFART_SETTINGS");
+
+	// getopt only knows short options, --resume is an alias for -c
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--resume"))
+			argv[i] = (char *)"-c";
+	}
+
+	while ((opt = getopt(argc, argv, "u:l:U:D:B:P:K:j:R:J:N:we:i:Q:cT:A:o:L:p:F:O:X:EIvrS:C:Z:Wm:M:")) != EOF) {
 		switch (opt) {
 		case 'u':
 			username = optarg;
 			break;
 
 		case 'l':
-			g_strlistname = optarg;
+			listname = optarg;
+			break;
+
+		case 'U': {
+			std::string parsed;
+			if (!playlist_uri_parse(optarg, parsed)) {
+				fprintf(stderr, "[!] Unrecognized playlist URI %s\n", optarg);
+				exit(1);
+			}
+			uri = optarg;
+			break;
+		}
+
+		case 'D':
+			socket_path = optarg;
+			break;
+
+		case 'B':
+			batch_path = optarg;
+			break;
+
+		case 'P':
+			shards = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		// set by the coordinator on its children
+		case 'K':
+			if (sscanf(optarg, "%d/%d", &config.shard_index, &config.shard_count) != 2 ||
+				config.shard_count < 1 || config.shard_index < 0 ||
+				config.shard_index >= config.shard_count) {
+				fprintf(stderr, "[!] Bad shard %s\n", optarg);
+				exit(1);
+			}
+			shard_child = true;
+			break;
+
+		case 'j':
+			config.max_jobs = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'R':
+			results_path = optarg;
+			break;
+
+		case 'J':
+			journal_path = optarg;
+			break;
+
+		case 'N':
+			config.snapshot_dir = optarg;
+			break;
+
+		case 'w':
+			config.watch = true;
+			break;
+
+		case 'e':
+			export_path = optarg;
+			break;
+
+		case 'i':
+			catalog_path = optarg;
+			break;
+
+		case 'Q':
+			query = optarg;
+			break;
+
+		case 'c':
+			resume = true;
+			break;
+
+		case 'T':
+			config.request_timeout = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'A':
+			config.max_attempts = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+
+		case 'o':
+			outdir = optarg;
+			break;
+
+		case 'L':
+			if (!strcmp(optarg, "flat")) {
+				config.layout = LAYOUT_FLAT;
+			} else if (!strcmp(optarg, "alpha")) {
+				config.layout = LAYOUT_ALPHA;
+			} else if (!strcmp(optarg, "hash")) {
+				config.layout = LAYOUT_HASH;
+			} else {
+				fprintf(stderr, "[!] Unknown layout %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'p':
+			if (!strcmp(optarg, "position")) {
+				config.order = ORDER_POSITION;
+			} else if (!strcmp(optarg, "fanout")) {
+				config.order = ORDER_FANOUT;
+			} else if (!strcmp(optarg, "fifo")) {
+				config.order = ORDER_FIFO;
+			} else {
+				fprintf(stderr, "[!] Unknown order %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'F':
+			if (!strcmp(optarg, "none")) {
+				config.sync_mode = DURABLE_NONE;
+			} else if (!strncmp(optarg, "batch", 5) &&
+				(optarg[5] == '\0' || optarg[5] == ':')) {
+				config.sync_mode = DURABLE_BATCH;
+				if (optarg[5] == ':')
+					config.sync_batch = atoi(optarg + 6) > 0 ? atoi(optarg + 6) : 1;
+			} else if (!strcmp(optarg, "file")) {
+				config.sync_mode = DURABLE_FILE;
+			} else {
+				fprintf(stderr, "[!] Unknown sync mode %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'O':
+#ifndef SPOTIFART_JPEG
+			fprintf(stderr, "[!] Built without jpeg support, no -O\n");
+			exit(1);
+#endif
+			config.optimize_threads = atoi(optarg) > 0 ? atoi(optarg) : 0;
+			break;
+
+		case 'X':
+			if (!derive_parse(optarg, config.derivatives))
+				exit(1);
+			break;
+
+		case 'E':
+			derive_only = true;
+			break;
+
+		case 'I':
+			config.embed_metadata = true;
 			break;
 
 		case 'v':
-			g_verbose = true;
+			config.verbose = true;
+			break;
+
+		case 'r':
+			remember = true;
+			break;
+
+		case 'S':
+			config.settings_location = optarg;
+			break;
+
+		case 'C':
+			config.cache_location = optarg;
+			break;
+
+		case 'Z':
+			config.cache_size = atoi(optarg);
+			break;
+
+		case 'W':
+			config.prewarm = true;
+			break;
+
+		case 'm':
+			metrics_path = optarg;
+			break;
+
+		case 'M':
+			metrics_port = atoi(optarg);
 			break;
 
 		default:
@@ -460,66 +464,148 @@ int main(int argc, char **argv)
 		}
 	}
 
-	// Create img dir if necessary
-	if (!create_dir("img"))
-		exit(1);
+	if (query) {
+		if (!catalog_path) {
+			fprintf(stderr, "[!] -Q needs a catalog (-i)\n");
+			exit(1);
+		}
+		return catalog_query(catalog_path, query) > 0 ? 0 : 1;
+	}
 
-	if (!username) {
+	if (derive_only) {
+		if (config.derivatives.empty()) {
+			fprintf(stderr, "[!] -E needs -X\n");
+			exit(1);
+		}
+		struct deriver *deriver = deriver_open(config.derivatives, config.derive_threads);
+		printf("[*] %d covers in %s\n", deriver_put_tree(deriver, outdir), outdir);
+		return deriver_close(deriver) ? 0 : 1;
+	}
+
+	if (!listname && !uri && !batch_path && !socket_path) {
 		usage(argv[0]);
 		exit(1);
 	}
 
-	// initialize sigint handler
-	signal(SIGINT, sig_handler);
+	if (config.watch && socket_path) {
+		fprintf(stderr, "[!] -w can't be used with -D\n");
+		exit(1);
+	}
+
+	// a shard never shards again
+	if (shards > 1 && config.shard_count == 1) {
+		if (socket_path) {
+			fprintf(stderr, "[!] -P can't be used with -D\n");
+			exit(1);
+		}
+		shard_options opts;
+		opts.shards = shards;
+		opts.username = username;
+		opts.cache_location = config.cache_location;
+		opts.settings_location = config.settings_location;
+		opts.batch_path = batch_path;
+		opts.results_path = results_path;
+		opts.journal_path = journal_path;
+		opts.snapshot_dir = config.snapshot_dir;
+		opts.export_path = export_path;
+		opts.metrics_path = metrics_path;
+		opts.metrics_port = metrics_port;
+		return shard_run(opts, argc, argv);
+	}
 
-	// initialize libspotify callbacks and spconfig
-	init_callbacks();
+#ifndef _WIN32
+	// only a child of -P was handed one, nobody else may slip it in
+	if (shard_child)
+		password = handed_password();
+#endif
 
-	// Create session
-	err = sp_session_create(&spconfig, &sp);
+	// shards share the terminal, keep their lines whole
+	if (config.shard_count > 1) {
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		setvbuf(stderr, NULL, _IOLBF, 0);
+	}
 
-	if (SP_ERROR_OK != err) {
-		fprintf(stderr, "[!] Unable to create session: %s\n",
-			sp_error_message(err));
+	if (results_path) {
+		g_results = fopen(results_path, "a");
+		if (!g_results) {
+			fprintf(stderr, "[!] Unable to open results file %s\n", results_path);
+			exit(1);
+		}
+	}
+
+	if (resume && !journal_path) {
+		fprintf(stderr, "[!] --resume needs a journal (-J)\n");
 		exit(1);
 	}
+	if (journal_path) {
+		config.journal = journal_open(journal_path, resume);
+		if (!config.journal)
+			exit(1);
+	}
+	if (export_path) {
+		size_t n = strlen(export_path);
+		bool csv = n >= 4 && !strcmp(export_path + n - 4, ".csv");
+		config.exporter = export_open(export_path, csv ? EXPORT_CSV : EXPORT_JSONL);
+		if (!config.exporter)
+			exit(1);
+	}
+	if (catalog_path) {
+		config.catalog = catalog_open(catalog_path);
+		if (!config.catalog)
+			exit(1);
+	}
 
-	g_session = sp;
+	srand((unsigned int)time(NULL));
 
-	sp_session_login(sp, username, get_password().c_str(), 0, NULL);
+	CoverFetcher fetcher(config);
+	g_fetcher = &fetcher;
 
-	// Create track worker
-	std::thread track_worker(track_work);
+	// initialize sigint handler
+	signal(SIGINT, sig_handler);
+
+	if (!fetcher.open())
+		exit(1);
 
-	std::unique_lock<std::mutex> lock(g_notify_mutex);
+	if (!metrics_start(metrics_path, metrics_port, 5))
+		exit(1);
 
-	while (g_todo_items) {
-		g_notify_cond.wait_for(lock,
-			std::chrono::milliseconds(next_timeout), predicate);
+	if (!session_login(fetcher, username, config.settings_location, remember, password))
+		exit(1);
 
-		g_notify_do = 0;
-		g_notify_mutex.unlock();
+	// jobs from the command line run before any from the socket
+	if (listname)
+		job_submit(listname, outdir, -1);
+	if (uri)
+		job_submit(uri, outdir, -1);
+	if (batch_path && !batch_submit(batch_path, outdir))
+		exit(1);
+	if (socket_path && !daemon_start(socket_path, outdir, job_submit))
+		exit(1);
 
-		do {
-			sp_session_process_events(sp, &next_timeout);
-		} while (next_timeout == 0);
+	bool ok = fetcher.run(socket_path != NULL);
+	bool derived = fetcher.finish();
 
-		// if the playlist of interest has been found, scan the tracks.
-		// important not to do the callback registration changes here in main,
-		// not in a callback
-		if (g_playlist) {
-			sp_playlist_add_callbacks(g_playlist, &pl_scan_callbacks, NULL);
-			sp_playlist_remove_callbacks(g_playlist, &pl_skim_callbacks, NULL);
-		}
+	daemon_stop();
 
-		g_notify_mutex.lock();
+	const std::vector<std::string> &failures = fetcher.failures();
+	if (!failures.empty()) {
+		fprintf(stderr, "[!] %u failures:\n", (unsigned int)failures.size());
+		for (size_t i = 0; i < failures.size(); ++i)
+			fprintf(stderr, "[!]   %s\n", failures[i].c_str());
 	}
-	
-	g_track_worker_run = false;
-	track_worker.join();
 
-	sp_session_logout(g_session);
+	metrics_stop();
 
-	return 0;
-}
+	if (g_results)
+		fclose(g_results);
+	g_results = NULL;
+	journal_close(config.journal);
+	export_close(config.exporter);
+	catalog_close(config.catalog);
 
+	// 2 tells a wrapper the run stopped short and --resume carries on.
+	// A daemon is only ever stopped, that alone is no reason
+	if (g_jobs_interrupted || (fetcher.stopped() && !socket_path))
+		return 2;
+	return (!ok || !derived || g_jobs_failed || !failures.empty()) ? 1 : 0;
+}
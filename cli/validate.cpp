@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <string.h>
+
+// glibc's memchr() already runs on AVX2 and beats a plain SSE2 loop about
+// two to one, elsewhere (MSVC, older C libraries) do the 16 bytes ourselves
+#if !defined(__GLIBC__) && \
+	(defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HAVE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "validate.h"
+
+// markers we care about, the byte after the 0xff
+#define M_SOF0 0xc0
+#define M_DHT 0xc4
+#define M_JPG 0xc8
+#define M_DAC 0xcc
+#define M_RST0 0xd0
+#define M_RST7 0xd7
+#define M_SOI 0xd8
+#define M_EOI 0xd9
+#define M_SOS 0xda
+#define M_TEM 0x01
+
+static bool is_sof(uint8_t m)
+{
+	return m >= M_SOF0 && m <= 0xcf && m != M_DHT && m != M_JPG && m != M_DAC;
+}
+
+// the byte after a 0xff in entropy-coded data: does the scan go on?
+static bool scan_continues(uint8_t m)
+{
+	return m == 0x00 || m == 0xff || (m >= M_RST0 && m <= M_RST7);
+}
+
+#ifdef HAVE_SSE2
+static int lowest_bit(int mask)
+{
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanForward(&bit, mask);
+	return (int)bit;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+/**
+ * Skip entropy-coded data to the marker that ends it. Stuffed 0xff00,
+ * restart markers and fill bytes belong to the scan. Returns a pointer to
+ * the 0xff of the marker, or end if there is none.
+ *
+ * The scan is nearly all of a JPEG, and nearly all its 0xffs are stuffed.
+ * With SSE2, compare 16 bytes at a time and walk every 0xff in the block
+ * from the mask, so a stuffed byte costs a bit test rather than another
+ * load.
+ */
+static const uint8_t *skip_scan(const uint8_t *p, const uint8_t *end)
+{
+#ifdef HAVE_SSE2
+	const __m128i ff = _mm_set1_epi8((char)0xff);
+	// leave one byte past the block for looking behind the last 0xff
+	while (end - p >= 17) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+		while (mask) {
+			int bit = lowest_bit(mask);
+			if (!scan_continues(p[bit + 1]))
+				return p + bit;
+			mask &= mask - 1;
+		}
+		p += 16;
+	}
+#endif
+	for (;;) {
+		const uint8_t *hit = (const uint8_t*)memchr(p, 0xff, end - p);
+		if (!hit || end - hit < 2)
+			return end;
+		if (!scan_continues(hit[1]))
+			return hit;
+		p = hit + 1;
+	}
+}
+
+jpeg_check jpeg_validate(const void *data, size_t len, const char **why)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	const uint8_t *end = p + len;
+	bool frame = false;
+	bool scan = false;
+	const char *dummy;
+	if (!why)
+		why = &dummy;
+
+	if (len < 4 || p[0] != 0xff || p[1] != M_SOI) {
+		*why = "not a JPEG";
+		return JPEG_NOT_JPEG;
+	}
+	p += 2;
+
+	while (p < end) {
+		if (*p != 0xff) {
+			*why = "garbage between segments";
+			return JPEG_BROKEN;
+		}
+		// any number of fill bytes may come before a marker
+		while (p < end && *p == 0xff)
+			++p;
+		if (p == end)
+			break;
+		uint8_t m = *p++;
+
+		if (m == M_EOI) {
+			if (!scan) {
+				*why = "no image data";
+				return JPEG_BROKEN;
+			}
+			return JPEG_OK;
+		}
+		if (m == M_SOI) {
+			*why = "second SOI";
+			return JPEG_BROKEN;
+		}
+		if (m == M_TEM || (m >= M_RST0 && m <= M_RST7))
+			continue;
+		if (m == 0x00) {
+			*why = "bad marker";
+			return JPEG_BROKEN;
+		}
+
+		if (end - p < 2) {
+			*why = "truncated";
+			return JPEG_BROKEN;
+		}
+		size_t seg = ((size_t)p[0] << 8) | p[1];
+		if (seg < 2 || seg > (size_t)(end - p)) {
+			*why = seg < 2 ? "bad segment length" : "truncated";
+			return JPEG_BROKEN;
+		}
+
+		if (is_sof(m)) {
+			// precision, height (0 is allowed, DNL gives it later), width,
+			// components
+			if (seg < 8 || !p[2] || (!p[5] && !p[6]) || !p[7]) {
+				*why = "bad frame header";
+				return JPEG_BROKEN;
+			}
+			frame = true;
+		}
+
+		p += seg;
+
+		if (m == M_SOS) {
+			if (!frame) {
+				*why = "scan before frame header";
+				return JPEG_BROKEN;
+			}
+			scan = true;
+			p = skip_scan(p, end);
+		}
+	}
+
+	*why = "truncated";
+	return JPEG_BROKEN;
+}
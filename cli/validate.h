@@ -0,0 +1,24 @@
+#ifndef SPOTIFART_VALIDATE_H
+#define SPOTIFART_VALIDATE_H
+
+#include <stddef.h>
+
+enum jpeg_check
+{
+	JPEG_OK,
+	JPEG_NOT_JPEG,		// doesn't even start like one
+	JPEG_BROKEN		// truncated or mangled somewhere
+};
+
+/**
+ * Structural check of a JPEG: SOI first, every marker segment inside the
+ * buffer with a sane length, a frame header before the first scan, and
+ * the entropy-coded data running on to an EOI. Nothing is decoded, so a
+ * cover passes in a fraction of the time it takes to write it, but a
+ * truncated download or an HTML error page doesn't.
+ *
+ * On failure why says what was wrong, as a static string.
+ */
+jpeg_check jpeg_validate(const void *data, size_t len, const char **why);
+
+#endif
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#define fsync _commit
+#define getpid _getpid
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// C++ headers
+#include <functional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// C++11 headers
+#include <chrono>
+
+#include "writer.h"
+
+// how long a batch may wait for more covers before it is committed anyway
+#define BATCH_MAX_AGE_MS 1000
+
+struct pending
+{
+	std::string tmp;
+	std::string filename;
+	std::function<void(bool ok)> committed;
+};
+
+struct writer
+{
+	durability mode;
+	size_t batch_size;
+	unsigned long serial;		// of the last temp file
+	std::vector<pending> batch;
+	std::chrono::steady_clock::time_point batch_started;
+};
+
+struct writer *writer_open(durability mode, int batch_size)
+{
+	struct writer *w = new struct writer;
+	w->mode = mode;
+	w->batch_size = batch_size > 0 ? batch_size : 1;
+	w->serial = 0;
+	return w;
+}
+
+void writer_close(struct writer *w)
+{
+	if (!w)
+		return;
+	writer_commit(w);
+	delete w;
+}
+
+static std::string dir_name(const std::string &path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+// Windows only commits files open for writing, Linux doesn't mind either way
+static bool sync_path(const std::string &path, bool dir)
+{
+	int fd = open(path.c_str(), (dir ? O_RDONLY : O_RDWR) | O_BINARY);
+	if (fd < 0)
+		return false;
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+// a rename is only durable once the directory holding it is synced.
+// Windows can't open a directory, and NTFS journals the rename anyway
+static void sync_dir(const std::string &dir)
+{
+#ifndef _WIN32
+	if (!sync_path(dir, true))
+		fprintf(stderr, "[!] Unable to sync %s: %s\n", dir.c_str(), strerror(errno));
+#endif
+}
+
+static bool rename_into_place(const std::string &tmp, const std::string &filename)
+{
+#ifdef _WIN32
+	remove(filename.c_str());
+#endif
+	if (rename(tmp.c_str(), filename.c_str()) != 0) {
+		fprintf(stderr, "[!] Unable to rename %s: %s\n", tmp.c_str(), strerror(errno));
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool write_all(int fd, const write_part *parts, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		const char *p = static_cast<const char*>(parts[i].data);
+		size_t len = parts[i].len;
+		while (len > 0) {
+			int n = write(fd, p, (unsigned int)len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= n;
+		}
+	}
+	return true;
+}
+
+#else
+
+// writev() may stop anywhere, pick up from wherever that was
+static bool write_all(int fd, const write_part *parts, int count)
+{
+	std::vector<struct iovec> iov;
+	for (int i = 0; i < count; ++i) {
+		if (!parts[i].len)
+			continue;
+		struct iovec v;
+		v.iov_base = const_cast<void*>(parts[i].data);
+		v.iov_len = parts[i].len;
+		iov.push_back(v);
+	}
+
+	size_t first = 0;
+	while (first < iov.size()) {
+		ssize_t n = writev(fd, &iov[first], (int)(iov.size() - first));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		while (first < iov.size() && (size_t)n >= iov[first].iov_len)
+			n -= iov[first++].iov_len;
+		if (first < iov.size()) {
+			iov[first].iov_base = (char*)iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+	return true;
+}
+
+#endif
+
+bool writer_put(struct writer *w, const std::string &filename, const void *data,
+	size_t len, const std::function<void(bool ok)> &committed)
+{
+	write_part part;
+	part.data = data;
+	part.len = len;
+	return writer_putv(w, filename, &part, 1, committed);
+}
+
+bool writer_putv(struct writer *w, const std::string &filename, const write_part *parts,
+	int count, const std::function<void(bool ok)> &committed)
+{
+	// a full batch is committed before the next cover joins it, never
+	// by the put that filled it, so the caller has counted that cover
+	// before committed can take it back
+	if (w->mode == DURABLE_BATCH && w->batch.size() >= w->batch_size)
+		writer_commit(w);
+
+	// two albums can share a file name, in one batch or in two shards,
+	// so every put gets a temp file of its own
+	std::stringstream ss;
+	ss << filename << "." << getpid() << "." << ++w->serial << ".part";
+	std::string tmp = ss.str();
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0)
+		return false;
+
+	bool ok = write_all(fd, parts, count);
+	if (ok && w->mode == DURABLE_FILE)
+		ok = fsync(fd) == 0;
+	if (close(fd) != 0)
+		ok = false;
+	if (!ok) {
+		remove(tmp.c_str());
+		return false;
+	}
+
+	if (w->mode == DURABLE_BATCH) {
+		if (w->batch.empty())
+			w->batch_started = std::chrono::steady_clock::now();
+		pending p;
+		p.tmp = tmp;
+		p.filename = filename;
+		p.committed = committed;
+		w->batch.push_back(p);
+		return true;
+	}
+
+	if (!rename_into_place(tmp, filename))
+		return false;
+	if (w->mode == DURABLE_FILE)
+		sync_dir(dir_name(filename));
+	if (committed)
+		committed(true);
+	return true;
+}
+
+void writer_tick(struct writer *w)
+{
+	if (!w || w->batch.empty())
+		return;
+	if (w->batch.size() >= w->batch_size ||
+		std::chrono::steady_clock::now() - w->batch_started >=
+		std::chrono::milliseconds(BATCH_MAX_AGE_MS))
+		writer_commit(w);
+}
+
+/**
+ * Sync every file of the batch, and only then rename them, so a crash
+ * leaves either the complete cover or a .part file. The directories are
+ * synced last, once each however many covers went into them.
+ */
+void writer_commit(struct writer *w)
+{
+	if (!w || w->batch.empty())
+		return;
+
+	std::vector<pending> batch;
+	batch.swap(w->batch);
+
+	std::vector<bool> synced(batch.size());
+	for (size_t i = 0; i < batch.size(); ++i) {
+		synced[i] = sync_path(batch[i].tmp, false);
+		if (!synced[i]) {
+			fprintf(stderr, "[!] Unable to sync %s: %s\n", batch[i].tmp.c_str(),
+				strerror(errno));
+			remove(batch[i].tmp.c_str());
+		}
+	}
+
+	std::set<std::string> dirs;
+	std::vector<bool> renamed(batch.size());
+	for (size_t i = 0; i < batch.size(); ++i) {
+		renamed[i] = synced[i] && rename_into_place(batch[i].tmp, batch[i].filename);
+		if (renamed[i])
+			dirs.insert(dir_name(batch[i].filename));
+	}
+
+	std::set<std::string>::iterator it;
+	for (it = dirs.begin(); it != dirs.end(); ++it)
+		sync_dir(*it);
+
+	// a failed rename has removed its .part file already
+	for (size_t i = 0; i < batch.size(); ++i) {
+		if (batch[i].committed)
+			batch[i].committed(renamed[i]);
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef SPOTIFART_WRITER_H
+#define SPOTIFART_WRITER_H
+
+#include <stddef.h>
+
+// C++ headers
+#include <functional>
+#include <string>
+
+// what has to be on disk before a cover counts as written
+enum durability
+{
+	DURABLE_NONE,		// rename into place, leave flushing to the OS
+	DURABLE_BATCH,		// fsync a batch of covers, then their directories
+	DURABLE_FILE		// fsync every cover and its directory
+};
+
+/**
+ * Cover file writer. Every cover goes to <name>.<pid>.<n>.part first and
+ * is renamed once complete, so a file under its real name is never
+ * truncated, and two covers with the same name never share a temp file.
+ *
+ * With DURABLE_BATCH the rename waits for the batch: once batch_size covers
+ * are written (or writer_tick() finds the oldest is a second old) they are
+ * all fsynced, renamed and their directories fsynced in one go, by the
+ * next put or tick. committed is called once a cover is in place under its
+ * real name, with the durability asked for, which may be after
+ * writer_put() returns but never from inside it. If the batch then fails
+ * the cover it is called with false instead, and the .part file is gone.
+ *
+ * Belongs to the fetcher thread, not thread safe. NULL is a valid writer
+ * for every call but writer_put().
+ */
+struct writer;
+
+struct writer *writer_open(durability mode, int batch_size);
+
+// commits whatever is left
+void writer_close(struct writer *w);
+
+bool writer_put(struct writer *w, const std::string &filename, const void *data,
+	size_t len, const std::function<void(bool ok)> &committed);
+
+// one piece of a file, see writer_putv()
+struct write_part
+{
+	const void *data;
+	size_t len;
+};
+
+// the file is the parts one after the other, written in one go (writev)
+// without ever being put together in memory
+bool writer_putv(struct writer *w, const std::string &filename, const write_part *parts,
+	int count, const std::function<void(bool ok)> &committed);
+
+// commit a batch that has been waiting too long
+void writer_tick(struct writer *w);
+
+// commit everything written so far
+void writer_commit(struct writer *w);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define snprintf _snprintf
+#endif
+
+// C++ headers
+#include <string>
+
+#include "xmp.h"
+
+// the APP1 identifier XMP readers look for, NUL included
+static const char xmp_ns[] = "http://ns.adobe.com/xap/1.0/";
+
+// a segment's length field covers itself, and tops out at 0xffff
+#define SEGMENT_MAX 0xffff
+
+static void append_escaped(std::string &out, const char *s)
+{
+	for (; s && *s; ++s) {
+		switch (*s) {
+		case '&': out += "&amp;"; break;
+		case '<': out += "&lt;"; break;
+		case '>': out += "&gt;"; break;
+		case '"': out += "&quot;"; break;
+		default: out += *s; break;
+		}
+	}
+}
+
+static void append_tag(std::string &out, const char *tag, const char *value)
+{
+	out += "   <";
+	out += tag;
+	out += '>';
+	append_escaped(out, value);
+	out += "</";
+	out += tag;
+	out += ">\n";
+}
+
+std::string xmp_segment(const cover_meta &meta)
+{
+	std::string xmp;
+	xmp += "<?xpacket begin=\"\xef\xbb\xbf\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n";
+	xmp += "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n";
+	xmp += " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n";
+	xmp += "  <rdf:Description rdf:about=\"\"\n";
+	xmp += "    xmlns:dc=\"http://purl.org/dc/elements/1.1/\"\n";
+	xmp += "    xmlns:xmpDM=\"http://ns.adobe.com/xmp/1.0/DynamicMedia/\"\n";
+	xmp += "    xmlns:spotifart=\"http://spotifart/ns/1.0/\">\n";
+	append_tag(xmp, "xmpDM:artist", meta.artist);
+	append_tag(xmp, "xmpDM:album", meta.album);
+	append_tag(xmp, "dc:source", meta.uri);
+	if (meta.year > 0) {
+		char year[16];
+		snprintf(year, sizeof(year), "%d", meta.year);
+		append_tag(xmp, "xmpDM:releaseDate", year);
+	}
+	if (meta.image_id) {
+		char hex[41];
+		for (int i = 0; i < 20; ++i)
+			snprintf(hex + i * 2, 3, "%02x", meta.image_id[i]);
+		append_tag(xmp, "spotifart:imageId", hex);
+	}
+	xmp += "  </rdf:Description>\n";
+	xmp += " </rdf:RDF>\n";
+	xmp += "</x:xmpmeta>\n";
+	xmp += "<?xpacket end=\"r\"?>";
+
+	size_t len = 2 + sizeof(xmp_ns) + xmp.size();
+	if (len > SEGMENT_MAX)
+		return std::string();
+
+	std::string seg;
+	seg.reserve(2 + len);
+	seg += '\xff';
+	seg += '\xe1';
+	seg += (char)(len >> 8);
+	seg += (char)(len & 0xff);
+	seg.append(xmp_ns, sizeof(xmp_ns));
+	seg += xmp;
+	return seg;
+}
+
+size_t xmp_offset(const void *data, size_t len)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	if (len < 2 || p[0] != 0xff || p[1] != 0xd8)
+		return 0;
+
+	static const char exif[] = "Exif\0";
+
+	size_t off = 2;
+	while (off + 4 <= len && p[off] == 0xff) {
+		size_t seg = ((size_t)p[off + 2] << 8) | p[off + 3];
+		if (seg < 2 || off + 2 + seg > len)
+			break;
+
+		// readers expect Exif right behind SOI/JFIF, so it stays ahead too
+		bool is_exif = p[off + 1] == 0xe1 && seg >= 2 + sizeof(exif) &&
+			memcmp(p + off + 4, exif, sizeof(exif)) == 0;
+		if (p[off + 1] != 0xe0 && !is_exif)
+			break;
+		off += 2 + seg;
+	}
+	return off;
+}
@@ -0,0 +1,34 @@
+#ifndef SPOTIFART_XMP_H
+#define SPOTIFART_XMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C++ headers
+#include <string>
+
+// what a cover says about where it came from
+struct cover_meta
+{
+	const char *artist;
+	const char *album;
+	const char *uri;	// spotify:album:...
+	int year;		// 0 if unknown
+	const uint8_t *image_id;	// 20 bytes, NULL if unknown
+};
+
+/**
+ * A complete APP1 segment, marker and length included, holding an XMP
+ * packet with the artist and album (xmpDM), the album link (dc:source),
+ * the year and the image ID. XMP rather than EXIF because names are UTF-8
+ * and EXIF strings are ASCII. Empty if it won't fit in one segment.
+ */
+std::string xmp_segment(const cover_meta &meta);
+
+/**
+ * Where the segment goes in a JPEG: after SOI, any JFIF APP0 and any Exif
+ * APP1, which have to come first. 0 if data doesn't start like a JPEG.
+ */
+size_t xmp_offset(const void *data, size_t len);
+
+#endif